@@ -9,29 +9,215 @@
 #include "app.h"
 #include "inode.h"
 
+/* The generation number of an inode changes whenever the inode is written,
+ * so that other processes can tell whether their cached copy is stale. */
+#define FILE_GEN_CNT 64
+static uint file_gen[FILE_GEN_CNT];
+
 int getsize(inode_intf bs, uint ino) { return FILE_SYS_DISK_SIZE / BLOCK_SIZE; }
 
 int setsize(inode_intf bs, uint ino, uint newsize) { FATAL("cannot set size"); }
 
+/* GPID_FILE submits a disk request and waits for the message from GPID_DISK,
+ * so other processes can run during the transfer. The pages of GPID_FILE move
+ * while it is waiting, so a request uses the page given by mmu_alloc unless
+ * the block is already in such a page. For FILE_READ_RANGE, such reads are
+ * held with DISK_PLUG and waited for together, so the disk can merge them.
+ * A range of consecutive blocks is transferred with one request if it fits. */
+#define PAGE_SIZE 4096
+static char* disk_buf;
+static uint disk_pending, disk_batch;
+
+static void disk_wait() {
+    /* Release the held requests and wait for all of them. */
+    if (disk_pending) earth->disk_submit(GPID_FILE, 0, 0, NULL, 0);
+    for (; disk_pending; disk_pending--)
+        grass->sys_recv(GPID_DISK, NULL, NULL, 0);
+}
+
+static void disk_io(uint offset, uint nblocks, char* block, uint write) {
+    /* Copy the blocks from memory-mapped ROM without a disk request. */
+    uint block_no = FILE_SYS_DISK_START + offset;
+    uint nbytes   = nblocks * BLOCK_SIZE;
+    char* rom     = write ? NULL : earth->disk_map(block_no);
+    char* rom_end = write ? NULL : earth->disk_map(block_no + nblocks - 1);
+    if (rom && rom_end == rom + nbytes - BLOCK_SIZE) {
+        memcpy(block, rom, nbytes);
+        return;
+    }
+
+    uint direct = ((uint)block >= APPS_PAGES_BASE);
+    uint flags  = write ? DISK_WRITE : (direct && disk_batch ? DISK_PLUG : 0);
+    char* buf   = direct ? block : disk_buf;
+    if (write && !direct) memcpy(buf, block, nbytes);
+
+    /* Wait for the earlier requests if the disk queue takes no more. */
+    while (earth->disk_submit(GPID_FILE, block_no, nblocks, buf, flags) < 0)
+        disk_wait();
+    disk_pending++;
+    if (flags & DISK_PLUG) return;
+
+    disk_wait();
+    if (!write && !direct) memcpy(block, buf, nbytes);
+}
+
+static void disk_range(uint offset, uint nblocks, char* block, uint write) {
+    /* A request through disk_buf takes at most one page of blocks. */
+    uint direct = ((uint)block >= APPS_PAGES_BASE);
+    uint max    = direct ? DISK_MAX_NBLOCKS : PAGE_SIZE / BLOCK_SIZE;
+    for (uint n; nblocks; nblocks -= n) {
+        n = (nblocks < max) ? nblocks : max;
+        disk_io(offset, n, block, write);
+        offset += n;
+        block += n * BLOCK_SIZE;
+    }
+}
+
 int read(inode_intf bs, uint ino, uint offset, block_t* block) {
-    earth->disk_read(FILE_SYS_DISK_START + offset, 1, block->bytes);
+    disk_io(offset, 1, block->bytes, 0);
     return 0;
 }
 
 int write(inode_intf bs, uint ino, uint offset, block_t* block) {
-    earth->disk_write(FILE_SYS_DISK_START + offset, 1, block->bytes);
+    disk_io(offset, 1, block->bytes, 1);
+    return 0;
+}
+
+int read_range(inode_intf bs, uint ino, uint offset, uint nblocks,
+               block_t* blocks) {
+    disk_range(offset, nblocks, blocks->bytes, 0);
+    return 0;
+}
+
+int write_range(inode_intf bs, uint ino, uint offset, uint nblocks,
+                block_t* blocks) {
+    disk_range(offset, nblocks, blocks->bytes, 1);
+    return 0;
+}
+
+/* The block cache between the file system and the disk, which keeps the
+ * superblock, inode blocks and indirect blocks read again and again. */
+#define CACHE_NBLOCKS 64
+static block_t cache_blocks[CACHE_NBLOCKS];
+static inode_intf cache;
+
+/* Sequential read-ahead for FILE_READ: after two sequential reads of an inode,
+ * GPID_FILE prefetches the next window of blocks into a page of its stream,
+ * and waits for the disk only after replying, so the transfer overlaps with
+ * the reply. The window doubles whenever all the prefetched blocks are read,
+ * and halves whenever the stream breaks with some of them unread. */
+#define RA_STREAMS    4
+#define RA_MAX_WINDOW (PAGE_SIZE / BLOCK_SIZE)
+static struct stream {
+    uint ino, next;      /* the next sequential read is block next of ino */
+    uint start, nblocks; /* blocks [start, start + nblocks) are in buf */
+    uint window, used;   /* the read-ahead window, and the blocks read */
+    char* buf;           /* a page given by mmu_alloc */
+} streams[RA_STREAMS];
+static uint ra_hand;
+
+static void ra_retire(struct stream* s) {
+    /* Shrink the window if the prefetched blocks are wasted. */
+    if (s->used < s->nblocks && s->window > 1) s->window /= 2;
+    s->nblocks = s->used = 0;
+}
+
+static void ra_fill(inode_intf fs, struct stream* s, uint offset) {
+    /* The file system of FILESYS=0 may not implement getsize. */
+    int size = (FILESYS == 0) ? 0 : fs->getsize(fs, s->ino);
+    uint n   = (size > (int)offset) ? size - offset : 0;
+    if (n > s->window) n = s->window;
+
+    /* Read into the page directly with DISK_PLUG like FILE_READ_RANGE. The
+     * blocks written but not flushed yet are copied from the cache. */
+    disk_batch = 1;
+    cachedisk_direct(cache, 1);
+    if (n && inode_read_range(fs, s->ino, offset, n, (void*)s->buf) < 0) n = 0;
+    cachedisk_direct(cache, 0);
+    disk_batch = 0;
+
+    s->start   = offset;
+    s->nblocks = n;
+}
+
+static int ra_read(inode_intf fs, uint ino, uint offset, block_t* block) {
+    struct stream* s = NULL;
+    for (uint i = 0; i < RA_STREAMS; i++)
+        if (streams[i].window && streams[i].ino == ino) s = &streams[i];
+
+    if (s && offset >= s->start && offset < s->start + s->nblocks) {
+        memcpy(block, s->buf + (offset - s->start) * BLOCK_SIZE, BLOCK_SIZE);
+        s->used++;
+    } else if (fs->read(fs, ino, offset, block) < 0) {
+        return -1;
+    }
+
+    if (s == NULL) {
+        /* Start tracking ino with the least recently started stream. */
+        s       = &streams[ra_hand];
+        ra_hand = (ra_hand + 1) % RA_STREAMS;
+        ra_retire(s);
+        s->ino    = ino;
+        s->window = 2;
+    } else if (offset == s->next) {
+        /* Prefetch the next window when the blocks in buf run out. */
+        if (offset + 1 >= s->start + s->nblocks) {
+            uint all_used = s->nblocks && s->used == s->nblocks;
+            if (all_used && s->window < RA_MAX_WINDOW) s->window *= 2;
+            s->nblocks = s->used = 0;
+            ra_fill(fs, s, offset + 1);
+        }
+    } else {
+        ra_retire(s);
+    }
+    s->next = offset + 1;
     return 0;
 }
 
+/* The file system on the disk is consistent only as of the last sync, since
+ * the free list of treedisk and the dirty blocks of the cache are written
+ * lazily. After a crash, the writes since then may be lost, and the blocks
+ * allocated since then may be given out again by the stale free list. So
+ * GPID_FILE syncs after every FILE_SYNC_WRITES writes, and GPID_PROCESS asks
+ * for a sync whenever an app exits (see apps/system/sys_proc.c), which does
+ * nothing unless a write has succeeded since the last sync. A read-only disk
+ * (i.e., the flash ROM) rejects every write, so it is never written. */
+#define FILE_SYNC_WRITES 32
+static uint file_unsynced;
+
+static int file_sync_all(inode_intf fs) {
+    if (file_unsynced == 0) return 0;
+    int r = (FILESYS == 0) ? 0 : treedisk_sync(fs);
+    if (r == 0) r = cachedisk_flush(cache);
+    if (r == 0) file_unsynced = 0;
+    return r;
+}
+
+static void ra_invalidate(uint ino) {
+    for (uint i = 0; i < RA_STREAMS; i++)
+        if (streams[i].window && streams[i].ino == ino)
+            streams[i].nblocks = streams[i].used = 0;
+}
+
 int main() {
     SUCCESS("Enter kernel process GPID_FILE");
+    disk_buf = (char*)APPS_PAGES_BASE + earth->mmu_alloc() * PAGE_SIZE;
 
     /* Initialize the file system interface. */
-    struct inode_store disk = (struct inode_store){
-        .read = read, .write = write, .getsize = getsize, .setsize = setsize};
+    struct inode_store disk = (struct inode_store){.read        = read,
+                                                   .write       = write,
+                                                   .read_range  = read_range,
+                                                   .write_range = write_range,
+                                                   .getsize     = getsize,
+                                                   .setsize     = setsize};
+    cache = cachedisk_init(&disk, cache_blocks, CACHE_NBLOCKS);
+    for (uint i = 0; i < RA_STREAMS; i++) {
+        uint page_id   = earth->mmu_alloc();
+        streams[i].buf = (char*)APPS_PAGES_BASE + page_id * PAGE_SIZE;
+    }
 
     inode_intf fs =
-        (FILESYS == 0) ? mydisk_init(&disk, 0) : treedisk_init(&disk, 0);
+        (FILESYS == 0) ? mydisk_init(cache, 0) : treedisk_init(cache, 0);
 
     /* Send a notification to GPID_PROCESS. */
     char buf[SYSCALL_MSG_LEN];
@@ -47,12 +233,60 @@ int main() {
 
         switch (req->type) {
         case FILE_READ:
-            r = fs->read(fs, req->ino, req->offset, (void*)&reply->block);
+            r = ra_read(fs, req->ino, req->offset, (void*)&reply->block);
             reply->status = r == 0 ? FILE_OK : FILE_ERROR;
             grass->sys_send(sender, (void*)reply, sizeof(*reply));
+            /* Wait for the read-ahead after replying. */
+            disk_wait();
+            break;
+        case FILE_READ_RANGE:
+            /* Only system processes can ask for a write to physical memory. */
+            r          = (sender < GPID_USER_START) ? 0 : -1;
+            disk_batch = 1;
+            cachedisk_direct(cache, 1);
+            if (r == 0)
+                r = inode_read_range(fs, req->ino, req->offset, req->nblocks,
+                                     (void*)req->dst);
+            cachedisk_direct(cache, 0);
+            disk_batch = 0;
+            disk_wait();
+            reply->status = r == 0 ? FILE_OK : FILE_ERROR;
+            grass->sys_send(sender, (void*)reply, sizeof(reply->status));
+            break;
+        case FILE_STAT:
+            reply->gen    = file_gen[req->ino % FILE_GEN_CNT];
+            reply->status = FILE_OK;
+            grass->sys_send(sender, (void*)reply, sizeof(*reply));
             break;
         case FILE_WRITE:
-            /* The FILE_WRITE case is left to students as an exercise. */
+            ra_invalidate(req->ino);
+            r = earth->disk_readonly
+                    ? -1
+                    : fs->write(fs, req->ino, req->offset, &req->block);
+            if (r == 0) file_gen[req->ino % FILE_GEN_CNT]++;
+            reply->status = r == 0 ? FILE_OK : FILE_ERROR;
+            grass->sys_send(sender, (void*)reply, sizeof(reply->status));
+            /* Sync after replying, like the read-ahead of FILE_READ. */
+            if (r == 0 && ++file_unsynced >= FILE_SYNC_WRITES)
+                file_sync_all(fs);
+            break;
+        case FILE_SYNC:
+            r = file_sync_all(fs);
+            /* Write back the RAM disk as well (see earth/dev_disk.c) when
+             * asked by an app, not when GPID_PROCESS syncs after an exit. */
+            if (r == 0 && sender >= GPID_USER_START) earth->disk_flush();
+            struct cache_stat stat;
+            cachedisk_stat(cache, &stat);
+            reply->hits   = stat.hits;
+            reply->misses = stat.misses;
+            reply->status = r == 0 ? FILE_OK : FILE_ERROR;
+            grass->sys_send(sender, (void*)reply, sizeof(*reply));
+            break;
+        case FILE_IOSTAT:
+            earth->disk_stat(&reply->stat);
+            reply->status = FILE_OK;
+            grass->sys_send(sender, (void*)reply, sizeof(*reply));
+            break;
         default:
             FATAL("sys_file: invalid request %d", req->type);
         }
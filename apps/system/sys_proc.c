@@ -11,8 +11,9 @@
 #include "disk.h"
 
 static int app_ino, app_pid;
-static void sys_spawn(uint base);
+static void sys_spawn(char* buf);
 static int app_spawn(struct proc_request* req);
+static void app_fork(int ppid);
 
 struct multicore {
     int boot_lock, booted_core_cnt; /* See earth/boot.s */
@@ -31,15 +32,7 @@ int main(int unused, struct multicore* boot) {
     int sender, shell_waiting;
     char buf[SYSCALL_MSG_LEN];
 
-    sys_spawn(SYS_TERM_EXEC_START);
-    grass->sys_recv(GPID_TERMINAL, NULL, buf, SYSCALL_MSG_LEN);
-    INFO("sys_process receives: %s", buf);
-
-    sys_spawn(SYS_FILE_EXEC_START);
-    grass->sys_recv(GPID_FILE, NULL, buf, SYSCALL_MSG_LEN);
-    INFO("sys_process receives: %s", buf);
-
-    sys_spawn(SYS_SHELL_EXEC_START);
+    sys_spawn(buf);
 
     while (1) {
         struct proc_request* req = (void*)buf;
@@ -58,6 +51,9 @@ int main(int unused, struct multicore* boot) {
             break;
         case PROC_EXIT:
             grass->proc_free(sender);
+            /* Make the files written by the app survive a crash. */
+            uint hits, misses;
+            file_sync(&hits, &misses);
 
             if (shell_waiting && app_pid == sender)
                 grass->sys_send(GPID_SHELL, (void*)reply, sizeof(*reply));
@@ -67,6 +63,14 @@ int main(int unused, struct multicore* boot) {
         case PROC_KILLALL:
             grass->proc_free(GPID_ALL);
             break;
+        case PROC_FORK:
+            app_fork(sender);
+            break;
+        case PROC_MEMSTAT:
+            reply->nstats = earth->mmu_stat(reply->stats, PROC_MEMSTAT_CNT);
+            reply->type   = CMD_OK;
+            grass->sys_send(sender, (void*)reply, sizeof(*reply));
+            break;
         /* Student's code goes here (System Call & Protection). */
 
         /* Add a case which handles process sleep. */
@@ -78,32 +82,219 @@ int main(int unused, struct multicore* boot) {
     }
 }
 
-static void app_read(uint off, char* dst) { file_read(app_ino, off, dst); }
+static void app_read(uint off, uint nblocks, char* dst) {
+    /* GPID_FILE can only write to the pages given by earth->mmu_alloc. */
+    if ((uint)dst >= APPS_PAGES_BASE) {
+        file_read_range(app_ino, off, nblocks, dst);
+    } else {
+        for (uint i = 0; i < nblocks; i++)
+            file_read(app_ino, off + i, dst + i * BLOCK_SIZE);
+    }
+}
+
+/* The code below caches the code and data pages of recently spawned apps.
+ * The pages of cache entry i are owned by pid EXEC_CACHE_PID(i), and a new
+ * process shares them (copy-on-write) instead of reading the executable.
+ * earth->mmu_alloc frees such pages when running out of memory, in which
+ * case the entry is loaded again (see exec_cache_resident). */
+#define EXEC_CACHE_PAGES  96 /* keep at most 384KB of cached pages */
+#define EXEC_CACHE_PID(i) (GPID_EXEC_CACHE - (i))
+
+struct exec_cache {
+    int use;
+    int ino;
+    uint gen;       /* generation of ino when it was loaded */
+    uint npages;    /* # pages of code and data */
+    uint last_used; /* for the LRU replacement */
+} exec_cache[EXEC_CACHE_CNT];
+
+static void exec_cache_free(int idx) {
+    earth->mmu_free(EXEC_CACHE_PID(idx));
+    memset(&exec_cache[idx], 0, sizeof(struct exec_cache));
+}
+
+static int exec_cache_resident(int idx) {
+    static struct mmu_stat stats[128];
+    uint cnt = earth->mmu_stat(stats, sizeof(stats) / sizeof(stats[0]));
+    for (uint i = 1; i < cnt; i++)
+        if (stats[i].pid == EXEC_CACHE_PID(idx)) return 1;
+    return 0;
+}
+
+static int exec_cache_get(int ino) {
+    static uint clock;
+    uint gen;
+    file_stat(ino, &gen);
+
+    for (uint i = 0; i < EXEC_CACHE_CNT; i++) {
+        struct exec_cache* exec = &exec_cache[i];
+        if (!exec->use || exec->ino != ino) continue;
+        if (exec->gen == gen && exec_cache_resident(i)) {
+            exec->last_used = ++clock;
+            return i;
+        }
+        /* Drop the entry of ino, which is modified or has been reclaimed. */
+        exec_cache_free(i);
+    }
+
+    /* Find a free entry, or else the least recently used one. */
+    int idx = 0;
+    for (uint i = 0; i < EXEC_CACHE_CNT; i++) {
+        struct exec_cache* exec = &exec_cache[i];
+        struct exec_cache* lru  = &exec_cache[idx];
+        if (lru->use && (!exec->use || exec->last_used < lru->last_used))
+            idx = i;
+    }
+
+    /* Load the executable into the entry. */
+    struct exec_cache* exec = &exec_cache[idx];
+    if (exec->use) exec_cache_free(idx);
+    app_ino    = ino;
+    int npages = elf_load_segments(EXEC_CACHE_PID(idx), app_read, NULL);
+    if (npages <= 0) {
+        exec_cache_free(idx);
+        return -1;
+    }
+    exec->use       = 1;
+    exec->ino       = ino;
+    exec->gen       = gen;
+    exec->npages    = npages;
+    exec->last_used = ++clock;
+    return idx;
+}
+
+static void exec_cache_trim(int keep) {
+    /* Do not keep an executable larger than the whole cache. */
+    if (exec_cache[keep].npages > EXEC_CACHE_PAGES) exec_cache_free(keep);
+
+    /* Free the least recently used entries other than keep if needed. */
+    while (1) {
+        int lru = -1, npages = 0;
+        for (uint i = 0; i < EXEC_CACHE_CNT; i++) {
+            struct exec_cache* exec = &exec_cache[i];
+            if (!exec->use) continue;
+            npages += exec->npages;
+            if (i != keep &&
+                (lru < 0 || exec->last_used < exec_cache[lru].last_used))
+                lru = i;
+        }
+        if (npages <= EXEC_CACHE_PAGES || lru < 0) return;
+        exec_cache_free(lru);
+    }
+}
+
+static void lib_load() {
+    /* Load the shared C library into the pages of GPID_LIB only once. */
+    static int loaded;
+    if (loaded) return;
+
+    int lib_ino = dir_lookup(0, "lib/");
+    if (lib_ino < 0 || (app_ino = dir_lookup(lib_ino, "libegos")) < 0)
+        FATAL("sys_process: fail to find /lib/libegos");
+    if (elf_load_segments(GPID_LIB, app_read, NULL) <= 0)
+        FATAL("sys_process: fail to load /lib/libegos");
+    loaded = 1;
+}
 
 static int app_spawn(struct proc_request* req) {
-    int bin_ino = dir_lookup(0, "bin/");
-    if ((app_ino = dir_lookup(bin_ino, req->argv[0])) < 0) return CMD_ERROR;
+    static int bin_ino = -1;
+    if (bin_ino < 0) bin_ino = dir_lookup(0, "bin/");
+    int ino = dir_lookup(bin_ino, req->argv[0]);
+    if (ino < 0) return CMD_ERROR;
     int argc = req->argv[req->argc - 1][0] == '&' ? req->argc - 1 : req->argc;
 
+    lib_load();
+    int idx = exec_cache_get(ino);
+    if (idx < 0) return CMD_ERROR;
     app_pid = grass->proc_alloc();
-    elf_load(app_pid, app_read, argc, (void**)req->argv);
+    earth->mmu_fork(EXEC_CACHE_PID(idx), app_pid);
+    /* Every user app is linked against the library at APPS_LIB_BASE. */
+    earth->mmu_fork(GPID_LIB, app_pid);
+    elf_load_args(app_pid, argc, (void**)req->argv);
     grass->proc_set_ready(app_pid);
 
+    exec_cache_trim(idx);
     return CMD_OK;
 }
 
-static int sys_apps_base;
-char* sys_apps[] = {"sys_process", "sys_terminal", "sys_file", "sys_shell"};
+static void app_fork(int ppid) {
+    struct proc_reply reply;
+    int pid = grass->proc_alloc();
+
+    /* A process not inside fork() would never receive the reply, so fail its
+     * fork without replying rather than block GPID_PROCESS. */
+    if (grass->proc_clone(ppid, pid) < 0) {
+        INFO("sys_process: process %d is not forking", ppid);
+        grass->proc_free(pid);
+        return;
+    }
 
-static void sys_proc_read(uint block_no, char* dst) {
-    earth->disk_read(sys_apps_base + block_no, 1, dst);
+    /* Share all the pages of ppid with pid (copy-on-write). */
+    earth->mmu_fork(ppid, pid);
+
+    /* Both processes are waiting for the reply of PROC_FORK. */
+    reply.type = CMD_OK;
+    reply.pid  = pid;
+    grass->sys_send(ppid, (void*)&reply, sizeof(reply));
+    reply.pid = 0;
+    grass->sys_send(pid, (void*)&reply, sizeof(reply));
 }
 
-static void sys_spawn(uint base) {
-    int pid = grass->proc_alloc();
-    INFO("Load kernel process #%d: %s", pid, sys_apps[pid - 1]);
+/* Below are the system servers in the order of their pids. A server starts
+ * after the servers in its deps have sent their initialization messages. */
+#define DEP(pid) (1 << (pid))
+struct sys_server {
+    char* name;
+    uint base;
+    uint deps;
+} sys_servers[] = {
+    {"sys_process", SYS_PROC_EXEC_START, 0},
+    {"sys_terminal", SYS_TERM_EXEC_START, 0},
+    {"sys_file", SYS_FILE_EXEC_START, 0},
+    {"sys_shell", SYS_SHELL_EXEC_START, DEP(GPID_TERMINAL) | DEP(GPID_FILE)},
+};
+static uint sys_apps_base, sys_loaded, sys_started, sys_inited;
 
-    sys_apps_base = base;
-    elf_load(pid, sys_proc_read, 0, NULL);
-    grass->proc_set_ready(pid);
+static void sys_proc_read(uint block_no, uint nblocks, char* dst) {
+    earth->disk_read(sys_apps_base + block_no, nblocks, dst);
+}
+
+static char* sys_proc_map(uint block_no) {
+    return earth->disk_map(sys_apps_base + block_no);
+}
+
+static void sys_start() {
+    for (uint pid = GPID_TERMINAL; pid <= GPID_SHELL; pid++)
+        if ((sys_loaded & ~sys_started & DEP(pid)) &&
+            (sys_servers[pid - 1].deps & ~sys_inited) == 0) {
+            grass->proc_set_ready(pid);
+            sys_started |= DEP(pid);
+        }
+}
+
+static void sys_spawn(char* buf) {
+    /* Start a server right after loading it if its deps are initialized,
+     * so that it initializes while the next server is being loaded. The
+     * synchronous earth->disk_read of sys_proc_read and the requests which
+     * a started sys_file submits are serialized by the disk lock (see
+     * earth/dev_disk.c). */
+    sys_inited = DEP(GPID_PROCESS);
+    for (uint i = GPID_TERMINAL; i <= GPID_SHELL; i++) {
+        int pid = grass->proc_alloc();
+        INFO("Load kernel process #%d: %s", pid, sys_servers[pid - 1].name);
+
+        sys_apps_base = sys_servers[pid - 1].base;
+        elf_load(pid, sys_proc_read, sys_proc_map, 0, NULL);
+        sys_loaded |= DEP(pid);
+        sys_start();
+    }
+
+    /* Wait for the initialization messages in any order. */
+    while (sys_started != sys_loaded) {
+        int sender;
+        grass->sys_recv(GPID_ALL, &sender, buf, SYSCALL_MSG_LEN);
+        INFO("sys_process receives: %s", buf);
+        sys_inited |= DEP(sender);
+        sys_start();
+    }
 }
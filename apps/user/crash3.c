@@ -0,0 +1,60 @@
+/*
+ * (C) 2025, Cornell University
+ * All rights reserved.
+ *
+ * Description: a program trying to map granted pages onto kernel memory
+ * The kernel should reject such page grants, as well as unaligned ones and
+ * those larger than the receiver's window, and report the error to both the
+ * sender and the receiver without leaving either of them blocked.
+ */
+
+#include "app.h"
+
+static char page[GRANT_PAGE_SIZE] __attribute__((aligned(GRANT_PAGE_SIZE)));
+
+static void receiver(void* window, uint npages) {
+    char msg[16];
+    int ret = sys_recv_pages(GPID_ALL, NULL, msg, sizeof(msg), window, &npages);
+    printf("crash3: receiver at %x got %d (%d pages)\n", window, ret, npages);
+}
+
+int main() {
+    /* Hostile windows at the kernel code and the system call arguments, and
+     * an unaligned one. */
+    void* windows[] = {(void*)RAM_START, (void*)SYSCALL_ARG, page + 8};
+
+    for (uint i = 0; i < sizeof(windows) / sizeof(windows[0]); i++) {
+        int pid = fork();
+        if (pid < 0) return -1;
+        if (pid == 0) {
+            receiver(windows[i], 1);
+            return 0;
+        }
+
+        int ret = sys_send_pages(pid, "grant", 6, page, 1);
+        printf("crash3: sender got %d\n", ret);
+        if (ret != -1) return -1;
+    }
+
+    /* An unaligned page given by the sender is rejected as well. */
+    int pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        receiver(page, 1);
+        return 0;
+    }
+    int ret = sys_send_pages(pid, "grant", 6, page + 8, 1);
+    printf("crash3: sender got %d\n", ret);
+    if (ret != -1) return -1;
+
+    /* So is a grant larger than the window of the receiver. */
+    pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        receiver(page, 0);
+        return 0;
+    }
+    ret = sys_send_pages(pid, "grant", 6, page, 1);
+    printf("crash3: sender got %d\n", ret);
+    return ret == -1 ? 0 : -1;
+}
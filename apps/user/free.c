@@ -0,0 +1,32 @@
+/*
+ * (C) 2025, Cornell University
+ * All rights reserved.
+ *
+ * Description: a simple free
+ * This app shows the usage of the page pool (i.e., the memory given out by
+ * earth->mmu_alloc) and the swap area on disk, as reported by GPID_PROCESS.
+ */
+
+#include "app.h"
+#include "disk.h"
+
+#define PAGE_KB 4
+
+int main(int argc, char** argv) {
+    struct mmu_stat pool;
+    proc_memstat(&pool, 1);
+
+    uint total = (RAM_END - APPS_PAGES_BASE) / 1024;
+    uint used  = (pool.resident + pool.pagetable + pool.shared) * PAGE_KB;
+    printf("Memory: %d KB total, %d KB used, %d KB free\n\r", total, used,
+           total - used);
+    printf("        %d KB private, %d KB shared, %d KB page tables\n\r",
+           pool.resident * PAGE_KB, pool.shared * PAGE_KB,
+           pool.pagetable * PAGE_KB);
+
+    total = SWAP_DISK_SIZE / 1024;
+    used  = pool.swapped * PAGE_KB;
+    printf("Swap:   %d KB total, %d KB used, %d KB free\n\r", total, used,
+           total - used);
+    return 0;
+}
@@ -0,0 +1,32 @@
+/*
+ * (C) 2025, Cornell University
+ * All rights reserved.
+ *
+ * Description: a simple iostat
+ * This app shows the disk commands counted by earth/dev_disk.c and reported by
+ * GPID_FILE, so that one can tell whether slow file operations are bound by
+ * the disk or by IPC.
+ */
+
+#include "app.h"
+#include "disk.h"
+
+int main(int argc, char** argv) {
+    struct disk_stat stat;
+    if (file_iostat(&stat) < 0) return -1;
+
+    printf("        COMMANDS\tBLOCKS\tKB\n\r");
+    printf("read    %d\t\t%d\t%d\n\r", stat.cmds[0], stat.blocks[0],
+           stat.blocks[0] * BLOCK_SIZE / 1024);
+    printf("write   %d\t\t%d\t%d\n\r", stat.cmds[1], stat.blocks[1],
+           stat.blocks[1] * BLOCK_SIZE / 1024);
+    printf("Disk busy for %d ms, CPU polling for %d ms\n\r",
+           (uint)(stat.busy_usec / 1000), (uint)(stat.poll_usec / 1000));
+
+    printf("Latency (usec)\tCOMMANDS\n\r");
+    for (uint i = 0; i < DISK_LAT_CNT; i++)
+        if (stat.latency[i])
+            printf("[%d, %d)\t%d\n\r", i ? 1 << i : 0, 1 << (i + 1),
+                   stat.latency[i]);
+    return 0;
+}
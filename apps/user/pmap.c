@@ -0,0 +1,31 @@
+/*
+ * (C) 2025, Cornell University
+ * All rights reserved.
+ *
+ * Description: a simple pmap
+ * This app shows the memory usage of every process, or only the processes
+ * given as arguments (e.g., pmap 4 5).
+ */
+
+#include "app.h"
+#include <stdlib.h>
+
+#define PAGE_KB 4
+
+int main(int argc, char** argv) {
+    static struct mmu_stat stats[PROC_MEMSTAT_CNT];
+    uint cnt = proc_memstat(stats, PROC_MEMSTAT_CNT);
+
+    printf("PID\tRESIDENT\tSHARED\tPAGETABLE\tSWAPPED\n\r");
+    for (uint i = 1; i < cnt; i++) {
+        uint shown = (argc == 1);
+        for (uint j = 1; j < argc; j++)
+            if (atoi(argv[j]) == stats[i].pid) shown = 1;
+        if (!shown) continue;
+
+        printf("%d\t%d KB\t\t%d KB\t%d KB\t\t%d KB\n\r", stats[i].pid,
+               stats[i].resident * PAGE_KB, stats[i].shared * PAGE_KB,
+               stats[i].pagetable * PAGE_KB, stats[i].swapped * PAGE_KB);
+    }
+    return 0;
+}
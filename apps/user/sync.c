@@ -0,0 +1,21 @@
+/*
+ * (C) 2025, Cornell University
+ * All rights reserved.
+ *
+ * Description: a simple sync
+ * This app asks GPID_FILE to write the dirty blocks in its block cache and
+ * then those in the RAM disk (when egos is built with RAMDISK=2) to the disk.
+ */
+
+#include "app.h"
+
+int main(int argc, char** argv) {
+    uint hits, misses;
+    if (file_sync(&hits, &misses) < 0) {
+        INFO("sync: fail to write back the block cache");
+        return -1;
+    }
+
+    printf("Block cache: %d hits, %d misses\n\r", hits, misses);
+    return 0;
+}
@@ -17,9 +17,14 @@
 #define VRES 600
 
 int main() {
-    /* This is tools/images/Bohr.bmp loaded into the ROM image by mkfs.c. */
-    char* rgb = (char*)(FLASH_ROM_BASE + EGOS_BIN_MAX_NBYTE * 5) +
-                (56 + HRES * VRES * 3) - 3;
+    /* This is tools/images/Bohr.bmp loaded into the ROM image by mkfs.c, and
+     * the pixels are read in place from the memory-mapped ROM. */
+    char* bmp = earth->disk_map(BOHR_BMP_EXEC_START);
+    if (bmp == NULL) {
+        INFO("video_demo: Bohr.bmp is not in the memory-mapped ROM");
+        return -1;
+    }
+    char* rgb = bmp + (56 + HRES * VRES * 3) - 3;
 
     /* The resolution for VGA/HDMI video output is 800*600. */
     for (uint i = 0; i < VRES; i++) {
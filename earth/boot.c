@@ -11,6 +11,7 @@
 void tty_init();
 void disk_init();
 void mmu_init();
+void plic_init(uint core_id);
 void intr_init(uint core_id);
 void grass_entry(uint core_id);
 
@@ -29,6 +30,8 @@ void boot() {
         CRITICAL("--- Booting on %s with core #%d ---",
                  earth->platform == HARDWARE ? "Hardware" : "QEMU", core_id);
 
+        /* Initialize the PLIC first for disk_init() to register a handler. */
+        plic_init(core_id);
         disk_init();
         SUCCESS("Finished initializing the tty and disk devices");
 
@@ -43,7 +46,8 @@ void boot() {
         /* Student's code goes here (Multicore & Locks). */
 
         /* Initialize the MMU and interrupts on this CPU core.
-         * Read mmu_init() and intr_init(), and decide what to do here. */
+         * Read mmu_init(), plic_init() and intr_init(), and decide what to do
+         * here. */
 
         /* Reset the timer, release the boot lock, and then hang the core
            by waiting for a timer interrupt using the wfi instruction. */
@@ -32,6 +32,58 @@ static void timer_reset(uint core_id) {
     mtimecmp_set(mtime_get() + QUANTUM, core_id);
 }
 
+/* The PLIC (Platform-Level Interrupt Controller) of QEMU routes the device
+ * interrupts to the cores, and a core claims and then completes an interrupt
+ * in its own context (i.e., context #(core_id * 2) for the machine mode). */
+#define PLIC_NIRQ              64
+#define PLIC_PRIORITY(irq)     ((irq) * 4)
+#define PLIC_ENABLE(ctx, irq)  (0x2000 + (ctx) * 0x80 + (irq) / 32 * 4)
+#define PLIC_THRESHOLD(ctx)    (0x200000 + (ctx) * 0x1000)
+#define PLIC_CLAIM(ctx)        (0x200004 + (ctx) * 0x1000)
+#define PLIC_CONTEXT(core_id)  ((core_id) * 2)
+
+static uint plic_cores; /* the cores taking external interrupts */
+static void (*intr_handlers[PLIC_NIRQ])(uint irq);
+
+static void plic_enable(uint irq, uint core_id) {
+    uint ctx = PLIC_CONTEXT(core_id);
+    REGW(PLIC_BASE, PLIC_ENABLE(ctx, irq)) |= 1 << (irq % 32);
+}
+
+static void intr_register(uint irq, void (*handler)(uint irq)) {
+    if (irq == 0 || irq >= PLIC_NIRQ) FATAL("intr_register: bad irq %d", irq);
+    intr_handlers[irq] = handler;
+    if (earth->platform != QEMU) return;
+
+    /* Enable irq with priority 1 on the cores taking external interrupts. */
+    REGW(PLIC_BASE, PLIC_PRIORITY(irq)) = 1;
+    for (uint core_id = 0; core_id < NCORES; core_id++)
+        if (plic_cores & (1 << core_id)) plic_enable(irq, core_id);
+}
+
+static void intr_dispatch(uint core_id) {
+    /* Claim, handle and complete the pending interrupts of this core. */
+    uint irq, ctx = PLIC_CONTEXT(core_id);
+    while (earth->platform == QEMU &&
+           (irq = REGW(PLIC_BASE, PLIC_CLAIM(ctx)))) {
+        if (irq < PLIC_NIRQ && intr_handlers[irq]) intr_handlers[irq](irq);
+        REGW(PLIC_BASE, PLIC_CLAIM(ctx)) = irq;
+    }
+}
+
+void plic_init(uint core_id) {
+    /* Initialize the PLIC for this core, so that the devices can register
+     * their handlers before intr_init() and grass enable the interrupts. */
+    earth->intr_register = intr_register;
+    earth->intr_dispatch = intr_dispatch;
+    if (earth->platform == QEMU) {
+        plic_cores |= 1 << core_id;
+        REGW(PLIC_BASE, PLIC_THRESHOLD(PLIC_CONTEXT(core_id))) = 0;
+        for (uint irq = 1; irq < PLIC_NIRQ; irq++)
+            if (intr_handlers[irq]) plic_enable(irq, core_id);
+    }
+}
+
 void trap_entry(); /* See grass/kernel.s */
 void intr_init(uint core_id) {
     /* Initialize the timer. */
@@ -42,7 +94,8 @@ void intr_init(uint core_id) {
     asm("csrw mtvec, %0" ::"r"(trap_entry));
     INFO("Use direct mode and put the address of the trap_entry into mtvec");
 
-    /* Enable timer interrupt. */
+    /* Enable timer interrupt. The external interrupt is enabled by grass
+     * once the kernel is ready to handle it (see grass/init.c). */
     asm("csrw mip, %0" ::"r"(0));
     asm("csrs mie, %0" ::"r"(0x80));
     asm("csrs mstatus, %0" ::"r"(0x88));
@@ -8,6 +8,8 @@
  */
 
 #include "egos.h"
+#include "disk.h"
+#include "servers.h"
 #include <string.h>
 
 #define PAGE_SIZE          4096
@@ -19,45 +21,335 @@ struct page_info {
     int use;
     int pid;
     uint vpage_no;
+    int referenced; /* second chance bit for the clock algorithm */
+    int ref;        /* # entries in page_share_table using this page */
+    int pagetable;  /* this page holds a page table of pid */
 } page_info_table[APPS_PAGES_CNT];
 
+static int curr_vm_pid = -1;
+static int pinned_pid[2] = {-1, -1}; /* pages of them are never swapped out */
+static int swap_out();
+void mmu_free(int pid);
+
+/* The executables cached by GPID_PROCESS can be read again from the disk, so
+ * their pages are freed before swapping out the pages of any process. Cache
+ * entry i is dropped in the order of exec_forked[i], the time of its latest
+ * mmu_fork, and an entry still being loaded (never forked) is kept. */
+#define EXEC_CACHE_IDX(pid) (GPID_EXEC_CACHE - (pid))
+#define IS_EXEC_CACHE(pid)                                                     \
+    (EXEC_CACHE_IDX(pid) >= 0 && EXEC_CACHE_IDX(pid) < EXEC_CACHE_CNT)
+static uint exec_forked[EXEC_CACHE_CNT], exec_clock;
+
+static int exec_reclaim() {
+    int lru = -1;
+    for (uint i = 0; i < EXEC_CACHE_CNT; i++) {
+        int pid = GPID_EXEC_CACHE - i;
+        if (!exec_forked[i] || pid == pinned_pid[0] || pid == pinned_pid[1])
+            continue;
+        if (lru < 0 || exec_forked[i] < exec_forked[lru]) lru = i;
+    }
+    if (lru < 0) return 0;
+    mmu_free(GPID_EXEC_CACHE - lru);
+    return 1;
+}
+
 uint mmu_alloc() {
-    for (uint i = 0; i < APPS_PAGES_CNT; i++)
-        if (!page_info_table[i].use) {
-            page_info_table[i].use = 1;
-            return i;
+    do {
+        for (uint i = 0; i < APPS_PAGES_CNT; i++)
+            if (!page_info_table[i].use) {
+                page_info_table[i].use = 1;
+                return i;
+            }
+    } while (exec_reclaim() || swap_out() > 0);
+    FATAL("mmu_alloc: no more free memory or swap space");
+}
+
+/* The code below keeps the memory usage of every process up to date as pages
+ * change hands, so that earth->mmu_stat() does not scan the tables per pid. */
+#define STAT_CNT 64
+
+static struct mmu_stat stat_table[STAT_CNT];
+
+static struct mmu_stat* stat_find(int pid) {
+    for (uint i = 0; pid && i < STAT_CNT; i++)
+        if (stat_table[i].pid == pid) return &stat_table[i];
+    return NULL;
+}
+
+static struct mmu_stat* stat_of(int pid) {
+    /* Pages with pid=0 (i.e., unmapped or shared pages) are not accounted. */
+    static struct mmu_stat unowned;
+    if (pid == 0) return &unowned;
+
+    struct mmu_stat* stat = stat_find(pid);
+    if (stat) return stat;
+
+    /* Recycle the entry of a pid holding no page, e.g., a freed pid. */
+    for (uint i = 0; i < STAT_CNT; i++) {
+        stat = &stat_table[i];
+        if (stat->resident || stat->pagetable || stat->shared || stat->swapped)
+            continue;
+        memset(stat, 0, sizeof(struct mmu_stat));
+        stat->pid = pid;
+        return stat;
+    }
+    FATAL("stat_of: no more entries in stat_table");
+}
+
+static void page_set_owner(uint ppage_id, int pid, uint vpage_no) {
+    struct page_info* page = &page_info_table[ppage_id];
+    stat_of(page->pid)->resident--;
+    stat_of(pid)->resident++;
+    page->pid      = pid;
+    page->vpage_no = vpage_no;
+}
+
+/* The code below swaps pages of user processes to the swap area on disk
+ * (see SWAP_DISK_START in disk.h) when the page pool is exhausted. */
+#define SWAP_PAGES_CNT        (SWAP_DISK_SIZE / PAGE_SIZE)
+#define SWAP_BATCH            8 /* max # pages in one disk read or write */
+#define BLOCKS_PER_PAGE       (PAGE_SIZE / BLOCK_SIZE)
+#define SWAP_SLOT_TO_BLOCK(x) (SWAP_DISK_START + (x) * BLOCKS_PER_PAGE)
+
+struct swap_info {
+    int use;
+    int pid;
+    uint vpage_no;
+} swap_info_table[SWAP_PAGES_CNT];
+
+static char swap_buf[SWAP_BATCH * PAGE_SIZE];
+
+static int swap_victim() {
+    /* Clock algorithm: give every referenced page a second chance. */
+    static uint clock_hand;
+    for (uint n = 0; n < 2 * APPS_PAGES_CNT; n++) {
+        struct page_info* page = &page_info_table[clock_hand];
+        clock_hand             = (clock_hand + 1) % APPS_PAGES_CNT;
+
+        /* Only evict the pages of user processes which are not running. */
+        if (!page->use || page->pagetable || page->pid < GPID_USER_START ||
+            page->pid == curr_vm_pid || page->pid == pinned_pid[0] ||
+            page->pid == pinned_pid[1])
+            continue;
+        if (page->referenced) {
+            page->referenced = 0;
+            continue;
         }
-    FATAL("mmu_alloc: no more free memory");
+        return page - page_info_table;
+    }
+    return -1;
+}
+
+static int swap_out() {
+    /* Nothing can be swapped out to a read-only disk. */
+    if (earth->disk_readonly) return 0;
+
+    /* Find at most SWAP_BATCH free swap slots next to each other. */
+    uint slot = 0, nslots = 0, run = 0;
+    for (uint i = 0; i < SWAP_PAGES_CNT && nslots < SWAP_BATCH; i++) {
+        run = swap_info_table[i].use ? 0 : run + 1;
+        if (run > nslots) {
+            nslots = run;
+            slot   = i + 1 - run;
+        }
+    }
+
+    /* Copy the victim pages to swap_buf and write them with one command. */
+    int victim, npages = 0;
+    while (npages < nslots && (victim = swap_victim()) >= 0) {
+        struct swap_info* swap = &swap_info_table[slot + npages];
+        swap->use              = 1;
+        swap->pid              = page_info_table[victim].pid;
+        swap->vpage_no         = page_info_table[victim].vpage_no;
+        memcpy(swap_buf + PAGE_SIZE * npages++, PAGE_ID_TO_ADDR(victim),
+               PAGE_SIZE);
+        stat_of(swap->pid)->resident--;
+        stat_of(swap->pid)->swapped++;
+        memset(&page_info_table[victim], 0, sizeof(struct page_info));
+    }
+
+    if (npages)
+        earth->disk_write(SWAP_SLOT_TO_BLOCK(slot), npages * BLOCKS_PER_PAGE,
+                          swap_buf);
+    return npages;
+}
+
+static void swap_in(int pid) {
+    for (uint i = 0; i < SWAP_PAGES_CNT; i++) {
+        if (!swap_info_table[i].use || swap_info_table[i].pid != pid) continue;
+
+        /* Allocate the pages first since mmu_alloc() may also use swap_buf. */
+        uint npages = 0, ppage_ids[SWAP_BATCH];
+        while (npages < SWAP_BATCH && i + npages < SWAP_PAGES_CNT &&
+               swap_info_table[i + npages].use &&
+               swap_info_table[i + npages].pid == pid)
+            ppage_ids[npages++] = mmu_alloc();
+
+        /* Read the consecutive swap slots of pid with one command. */
+        earth->disk_read(SWAP_SLOT_TO_BLOCK(i), npages * BLOCKS_PER_PAGE,
+                         swap_buf);
+        for (uint j = 0; j < npages; j++) {
+            struct swap_info* swap = &swap_info_table[i + j];
+            memcpy(PAGE_ID_TO_ADDR(ppage_ids[j]), swap_buf + PAGE_SIZE * j,
+                   PAGE_SIZE);
+            page_set_owner(ppage_ids[j], pid, swap->vpage_no);
+            stat_of(pid)->swapped--;
+            memset(swap, 0, sizeof(struct swap_info));
+        }
+        i += npages - 1;
+    }
+}
+
+/* The code below shares pages between a process and its fork() children.
+ * A shared page has pid=0 in page_info_table and its mappings are kept in
+ * page_share_table. The software TLB finds the shared pages modified by a
+ * process when unmapping the process, and gives the process a private copy
+ * of each such page (i.e., copy-on-write). */
+#define PAGES_SHARE_CNT    (APPS_PAGES_CNT * 4)
+#define ADDR_TO_PAGE_ID(x) (((uint)(x) - APPS_PAGES_BASE) / PAGE_SIZE)
+
+struct page_share {
+    int pid;
+    uint vpage_no;
+    char* paddr;
+} page_share_table[PAGES_SHARE_CNT];
+
+static void share_add(int pid, uint vpage_no, char* paddr) {
+    for (uint i = 0; i < PAGES_SHARE_CNT; i++)
+        if (page_share_table[i].pid == 0) {
+            page_share_table[i].pid      = pid;
+            page_share_table[i].vpage_no = vpage_no;
+            page_share_table[i].paddr    = paddr;
+            page_info_table[ADDR_TO_PAGE_ID(paddr)].ref++;
+            stat_of(pid)->shared++;
+            return;
+        }
+    FATAL("share_add: no more entries in page_share_table");
+}
+
+static void share_remove(struct page_share* share) {
+    stat_of(share->pid)->shared--;
+    struct page_info* page = &page_info_table[ADDR_TO_PAGE_ID(share->paddr)];
+    if (--page->ref == 0) memset(page, 0, sizeof(struct page_info));
+    memset(share, 0, sizeof(struct page_share));
+}
+
+void mmu_fork(int ppid, int pid) {
+    /* Bring back the swapped pages of ppid, so all of them can be shared. */
+    pinned_pid[0] = ppid;
+    swap_in(ppid);
+    pinned_pid[0] = -1;
+
+    for (uint i = 0; i < PAGES_SHARE_CNT; i++)
+        if (page_share_table[i].pid == ppid)
+            share_add(pid, page_share_table[i].vpage_no,
+                      page_share_table[i].paddr);
+
+    for (uint i = 0; i < APPS_PAGES_CNT; i++) {
+        struct page_info* page = &page_info_table[i];
+        if (!page->use || page->pagetable || page->pid != ppid) continue;
+
+        /* Turn the private page of ppid into a page shared by ppid and pid. */
+        uint vpage_no = page->vpage_no;
+        page_set_owner(i, 0, 0);
+        share_add(ppid, vpage_no, PAGE_ID_TO_ADDR(i));
+        share_add(pid, vpage_no, PAGE_ID_TO_ADDR(i));
+    }
+    if (IS_EXEC_CACHE(ppid)) exec_forked[EXEC_CACHE_IDX(ppid)] = ++exec_clock;
+}
+
+uint mmu_stat(struct mmu_stat* stats, uint n) {
+    /* stats[0] summarizes the page pool and the swap area (pid=0). */
+    memset(stats, 0, sizeof(struct mmu_stat));
+    for (uint i = 0; i < APPS_PAGES_CNT; i++) {
+        struct page_info* page = &page_info_table[i];
+        if (!page->use) continue;
+        if (page->pagetable) {
+            stats[0].pagetable++;
+        } else if (page->ref) {
+            stats[0].shared++;
+        } else {
+            stats[0].resident++;
+        }
+    }
+    for (uint i = 0; i < SWAP_PAGES_CNT; i++)
+        if (swap_info_table[i].use) stats[0].swapped++;
+
+    uint cnt = 1;
+    for (uint i = 0; i < STAT_CNT && cnt < n; i++) {
+        struct mmu_stat* stat = &stat_table[i];
+        if (stat->resident || stat->pagetable || stat->shared || stat->swapped)
+            stats[cnt++] = *stat;
+    }
+    return cnt;
 }
 
 void mmu_free(int pid) {
     for (uint i = 0; i < APPS_PAGES_CNT; i++)
         if (page_info_table[i].use && page_info_table[i].pid == pid)
             memset(&page_info_table[i], 0, sizeof(struct page_info));
+
+    for (uint i = 0; i < PAGES_SHARE_CNT; i++)
+        if (page_share_table[i].pid == pid) share_remove(&page_share_table[i]);
+
+    for (uint i = 0; i < SWAP_PAGES_CNT; i++)
+        if (swap_info_table[i].use && swap_info_table[i].pid == pid)
+            memset(&swap_info_table[i], 0, sizeof(struct swap_info));
+
+    struct mmu_stat* stat = stat_find(pid);
+    if (stat) memset(stat, 0, sizeof(struct mmu_stat));
+    if (IS_EXEC_CACHE(pid)) exec_forked[EXEC_CACHE_IDX(pid)] = 0;
 }
 
 void soft_tlb_map(int pid, uint vpage_no, uint ppage_id) {
-    page_info_table[ppage_id].pid      = pid;
-    page_info_table[ppage_id].vpage_no = vpage_no;
+    page_set_owner(ppage_id, pid, vpage_no);
+    page_info_table[ppage_id].referenced = 1;
 }
 
-void soft_tlb_switch(int pid) {
-    static int curr_vm_pid = -1;
-    if (pid == curr_vm_pid) return;
-
-    /* Unmap curr_vm_pid from the user address space. */
+static void soft_tlb_unmap() {
+    /* Write the user address space back to the pages of curr_vm_pid. */
     for (uint i = 0; i < APPS_PAGES_CNT; i++)
         if (page_info_table[i].use && page_info_table[i].pid == curr_vm_pid)
             memcpy(PAGE_ID_TO_ADDR(i),
                    PAGE_NO_TO_ADDR(page_info_table[i].vpage_no), PAGE_SIZE);
 
+    for (uint i = 0; i < PAGES_SHARE_CNT; i++) {
+        struct page_share* share = &page_share_table[i];
+        char* vaddr              = PAGE_NO_TO_ADDR(share->vpage_no);
+        if (share->pid != curr_vm_pid ||
+            !memcmp(vaddr, share->paddr, PAGE_SIZE))
+            continue;
+
+        /* Copy on write: curr_vm_pid has modified a shared page. */
+        uint vpage_no = share->vpage_no, ppage_id;
+        share_remove(share);
+        ppage_id = mmu_alloc();
+        memcpy(PAGE_ID_TO_ADDR(ppage_id), vaddr, PAGE_SIZE);
+        soft_tlb_map(curr_vm_pid, vpage_no, ppage_id);
+    }
+    curr_vm_pid = -1;
+}
+
+void soft_tlb_switch(int pid) {
+    if (pid == curr_vm_pid) return;
+    soft_tlb_unmap();
+
+    /* Bring back the pages of pid which have been swapped out. */
+    curr_vm_pid = pid;
+    swap_in(pid);
+
     /* Map pid to the user address space. */
     for (uint i = 0; i < APPS_PAGES_CNT; i++)
-        if (page_info_table[i].use && page_info_table[i].pid == pid)
+        if (page_info_table[i].use && page_info_table[i].pid == pid) {
             memcpy(PAGE_NO_TO_ADDR(page_info_table[i].vpage_no),
                    PAGE_ID_TO_ADDR(i), PAGE_SIZE);
+            page_info_table[i].referenced = 1;
+        }
 
-    curr_vm_pid = pid;
+    for (uint i = 0; i < PAGES_SHARE_CNT; i++)
+        if (page_share_table[i].pid == pid)
+            memcpy(PAGE_NO_TO_ADDR(page_share_table[i].vpage_no),
+                   page_share_table[i].paddr, PAGE_SIZE);
 }
 
 uint soft_tlb_translate(int pid, uint vaddr) {
@@ -65,6 +357,56 @@ uint soft_tlb_translate(int pid, uint vaddr) {
     return vaddr;
 }
 
+/* The code below moves pages from one process to another for the page
+ * granting system calls (see sys_send_pages in syscall.c). The kernel checks
+ * that both ranges are page-aligned and in the user app region beforehand. */
+static int page_lookup(int pid, uint vpage_no) {
+    for (uint i = 0; i < APPS_PAGES_CNT; i++)
+        if (page_info_table[i].use && page_info_table[i].pid == pid &&
+            page_info_table[i].vpage_no == vpage_no)
+            return i;
+
+    for (uint i = 0; i < PAGES_SHARE_CNT; i++) {
+        struct page_share* share = &page_share_table[i];
+        if (share->pid != pid || share->vpage_no != vpage_no) continue;
+
+        /* A shared page cannot be granted, so make a private copy of it. */
+        uint ppage_id = mmu_alloc();
+        memcpy(PAGE_ID_TO_ADDR(ppage_id), share->paddr, PAGE_SIZE);
+        share_remove(share);
+        soft_tlb_map(pid, vpage_no, ppage_id);
+        return ppage_id;
+    }
+    return -1;
+}
+
+uint mmu_grant(int from, uint from_vaddr, int to, uint to_vaddr, uint npages) {
+    /* Make sure that the pages of from and to are up to date in memory. */
+    soft_tlb_unmap();
+    pinned_pid[0] = from;
+    pinned_pid[1] = to;
+    swap_in(from);
+    swap_in(to);
+
+    uint n;
+    for (n = 0; n < npages; n++) {
+        uint from_vpage = from_vaddr / PAGE_SIZE + n;
+        uint to_vpage   = to_vaddr / PAGE_SIZE + n;
+        int src         = page_lookup(from, from_vpage);
+        int dst         = page_lookup(to, to_vpage);
+        if (src < 0) break;
+
+        /* Give from the page of to (or a new page) in exchange, zeroed. */
+        if (dst < 0) dst = mmu_alloc();
+        memset(PAGE_ID_TO_ADDR(dst), 0, PAGE_SIZE);
+        earth->mmu_map(to, to_vpage, src);
+        earth->mmu_map(from, from_vpage, dst);
+    }
+
+    pinned_pid[0] = pinned_pid[1] = -1;
+    return n;
+}
+
 /* The code below creates an identity map using page tables (RISC-V Sv32). */
 #define USER_RWX     (0xC0 | 0x1F)
 #define MAX_NPROCESS 256
@@ -73,6 +415,14 @@ static uint* leaf;
 static uint* pid_to_pagetable_base[MAX_NPROCESS];
 /* Assume at most MAX_NPROCESS unique processes just for simplicity. */
 
+static uint pagetable_alloc(int pid) {
+    uint ppage_id                       = earth->mmu_alloc();
+    page_info_table[ppage_id].pid       = pid;
+    page_info_table[ppage_id].pagetable = 1;
+    stat_of(pid)->pagetable++;
+    return ppage_id;
+}
+
 void setup_identity_region(int pid, uint addr, uint npages, uint flag) {
     uint vpn1 = addr >> 22;
 
@@ -81,9 +431,7 @@ void setup_identity_region(int pid, uint addr, uint npages, uint flag) {
         leaf = (void*)((root[vpn1] << 2) & 0xFFFFF000);
     } else {
         /* Allocate the leaf page table. */
-        uint ppage_id                 = earth->mmu_alloc();
-        leaf                          = (void*)PAGE_ID_TO_ADDR(ppage_id);
-        page_info_table[ppage_id].pid = pid;
+        leaf = (void*)PAGE_ID_TO_ADDR(pagetable_alloc(pid));
         memset(leaf, 0, PAGE_SIZE);
         root[vpn1] = ((uint)leaf >> 2) | 0x1;
     }
@@ -96,15 +444,15 @@ void setup_identity_region(int pid, uint addr, uint npages, uint flag) {
 
 void pagetable_identity_map(int pid) {
     /* Allocate the root page table. */
-    uint ppage_id                 = earth->mmu_alloc();
-    root                          = (void*)PAGE_ID_TO_ADDR(ppage_id);
-    page_info_table[ppage_id].pid = pid;
-    pid_to_pagetable_base[pid]    = root;
+    root                       = (void*)PAGE_ID_TO_ADDR(pagetable_alloc(pid));
+    pid_to_pagetable_base[pid] = root;
     memset(root, 0, PAGE_SIZE);
 
     /* Setup the identity map for various memory regions. */
-    for (uint i = RAM_START; i < RAM_END; i += PAGE_SIZE * 1024)
-        setup_identity_region(pid, i, 1024, USER_RWX);
+    for (uint i = RAM_START; i < RAM_END; i += PAGE_SIZE * 1024) {
+        uint npages = (RAM_END - i) / PAGE_SIZE;
+        setup_identity_region(pid, i, npages < 1024 ? npages : 1024, USER_RWX);
+    }
 
     setup_identity_region(pid, NIC_BASE, 4, USER_RWX);
     setup_identity_region(pid, UART_BASE, 1, USER_RWX);
@@ -113,6 +461,8 @@ void pagetable_identity_map(int pid) {
     setup_identity_region(pid, VIDEO_FRAME_BASE, 512, USER_RWX);
 
     if (earth->platform == QEMU) {
+        /* The RAM disk beyond RAM_END (see earth/dev_disk.c). */
+        setup_identity_region(pid, RAM_DISK_BASE, 512, USER_RWX);
         setup_identity_region(pid, SDHCI_BASE, 1, USER_RWX);
         setup_identity_region(pid, NIC_PCI_ECAM, 1, USER_RWX);
     } else {
@@ -191,6 +541,9 @@ void flush_cache() {
 
 void mmu_init() {
     earth->mmu_free        = mmu_free;
+    earth->mmu_fork        = mmu_fork;
+    earth->mmu_grant       = mmu_grant;
+    earth->mmu_stat        = mmu_stat;
     earth->mmu_alloc       = mmu_alloc;
     earth->mmu_flush_cache = flush_cache;
 
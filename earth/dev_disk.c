@@ -7,6 +7,7 @@
 
 #include "egos.h"
 #include "disk.h"
+#include "servers.h"
 #include <string.h>
 
 /* See the "SD Host Controller Simplified Specification" (Part A2) document
@@ -18,11 +19,29 @@
 #define SDHCI_CMD_AND_MODE     0x0C
 #define SDHCI_RESPONSE0        0x10
 #define SDHCI_PRESENT_STATE    0x24
+#define SDHCI_HOST_CONTROL     0x28
 #define SDHCI_CLKCON           0x2C
 #define SDHCI_SOFTWARE_RESET   0x2F
 #define SDHCI_INT_STAT         0x30
 #define SDHCI_INT_STAT_ENABLE  0x34
 #define SDHCI_INT_SIG_ENABLE   0x38
+#define SDHCI_ADMA_ADDRESS     0x58
+
+/* The statistics of disk commands, printed by apps/user/iostat.c. */
+#define MTIME_PER_USEC (earth->platform == QEMU ? 10 : 100)
+ulonglong mtime_get();
+static struct disk_stat iostat;
+
+static void disk_account(uint write, uint nblocks, ulonglong start) {
+    uint usec = (mtime_get() - start) / MTIME_PER_USEC;
+    iostat.cmds[write]++;
+    iostat.blocks[write] += nblocks;
+    iostat.busy_usec += usec;
+
+    uint i = 0;
+    while (i < DISK_LAT_CNT - 1 && (usec >> (i + 1))) i++;
+    iostat.latency[i]++;
+}
 
 static char sdhci_exec_cmd(uint idx, uint arg, uchar flag, uint mode) {
     /* Wait until the SD controller to be ready for a new command. */
@@ -39,19 +58,245 @@ static char sdhci_exec_cmd(uint idx, uint arg, uchar flag, uint mode) {
     while (!(REGW(SDHCI_BASE, SDHCI_INT_STAT) & 0x1));
 }
 
-static void sdhci_read(uint offset, char* dst) {
-    /* Prepare DMA (SDMA mode of SDHCI). */
-    static __attribute__((aligned(BLOCK_SIZE))) char aligned_buf[BLOCK_SIZE];
-    REGW(SDHCI_BASE, SDHCI_DMA_ADDRESS)      = (uint)aligned_buf;
-    REGW(SDHCI_BASE, SDHCI_BLK_CNT_AND_SIZE) = (1 << 16) | BLOCK_SIZE;
+/* The ADMA2 descriptor table (Section 1.13 of the same document) lets the
+ * controller transfer data straight into or out of the caller's buffer.
+ * Each descriptor covers the part of the buffer within one page frame. */
+#define PAGE_SIZE         4096
+#define ADMA2_DESC_CNT    64
+#define ADMA2_VALID       (1 << 0)
+#define ADMA2_END         (1 << 1)
+#define ADMA2_TRAN        (2 << 4)
+#define SDHCI_MAX_NBLOCKS ((ADMA2_DESC_CNT - 1) * PAGE_SIZE / BLOCK_SIZE)
+
+struct adma2_desc {
+    ushort attr;
+    ushort len;
+    uint addr;
+} adma2_table[ADMA2_DESC_CNT];
+static uint adma2_len; /* # descriptors in adma2_table */
+
+static int adma2_add(char* buf, uint nbytes) {
+    /* Append the descriptors of buf, or return -1 if they do not fit or buf
+     * is not 4-byte aligned as ADMA2 requires (see sdhci_read). */
+    if ((uint)buf & 0x3) return -1;
+    uint ndesc = ((uint)buf % PAGE_SIZE + nbytes + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (adma2_len + ndesc > ADMA2_DESC_CNT) return -1;
+
+    for (uint len; nbytes; nbytes -= len, buf += len) {
+        struct adma2_desc* desc = &adma2_table[adma2_len++];
+        len        = PAGE_SIZE - (uint)buf % PAGE_SIZE;
+        len        = (len < nbytes) ? len : nbytes;
+        desc->attr = ADMA2_VALID | ADMA2_TRAN;
+        desc->len  = len;
+        desc->addr = (uint)buf;
+    }
+    return 0;
+}
+
+#define DATA_PRESENT_FLAG (1 << 5)
+#define DMA_ENABLE_MODE   (1 << 0)
+#define READ_MODE         (1 << 4)
+#define MULTI_BLOCK_MODE  ((1 << 5) | (1 << 2) | (1 << 1))
+static void sdhci_start(uint offset, uint nblocks, uint write) {
+    /* Prepare DMA (ADMA2 mode of SDHCI) with the descriptors added. */
+    adma2_table[adma2_len - 1].attr |= ADMA2_END;
+    REGW(SDHCI_BASE, SDHCI_ADMA_ADDRESS)     = (uint)adma2_table;
+    REGW(SDHCI_BASE, SDHCI_BLK_CNT_AND_SIZE) = (nblocks << 16) | BLOCK_SIZE;
+
+    /* Read with command #17 and write with command #24, or with command #18
+     * and #25 for multiple blocks followed by the stop command #12. */
+    uint idx  = write ? 24 : 17;
+    uint mode = write ? DMA_ENABLE_MODE : DMA_ENABLE_MODE | READ_MODE;
+    if (nblocks > 1) {
+        idx++;
+        mode |= MULTI_BLOCK_MODE;
+    }
+    sdhci_exec_cmd(idx, offset * BLOCK_SIZE, DATA_PRESENT_FLAG, mode);
+}
+
+static void sdhci_wait() {
+    /* Wait for the data transfer to be completed and clear its status. */
+    while (!(REGW(SDHCI_BASE, SDHCI_INT_STAT) & 0x2));
+    REGW(SDHCI_BASE, SDHCI_INT_STAT) = 0x2;
+}
+
+/* The requests from disk_submit() are scheduled in the order of their block
+ * numbers (C-SCAN), and the queued requests continuing the same run of blocks
+ * are merged into one SDHCI command, which interrupts the CPU when the data
+ * transfer completes. A request stays in the queue until disk_complete().
+ * The synchronous transfers of disk_read() and disk_write() are queued too,
+ * by GPID_DISK, so that they are ordered with the requests of overlapping
+ * blocks submitted before them. */
+#define DISK_QUEUE_LEN    32
+#define DISK_CLIENT_DEPTH 8 /* max # requests of a process in the queue */
+struct disk_request {
+    enum { REQ_FREE, REQ_QUEUED, REQ_ACTIVE, REQ_DONE } state;
+    int pid;
+    uint block_no, nblocks, write;
+    char* buf;
+    uint seq; /* the order of submission */
+} disk_queue[DISK_QUEUE_LEN];
+static uint disk_busy, disk_plugged, disk_seq;
+static uint disk_pos; /* the block after the last transfer */
+static uint disk_cmd_write, disk_cmd_nblocks;
+static ulonglong disk_cmd_start;
+
+static int disk_ready(struct disk_request* req) {
+    /* A request waits for the earlier requests of overlapping blocks if any
+     * of them writes, so sorting and merging never reorder such requests. */
+    for (struct disk_request* r = disk_queue; r < disk_queue + DISK_QUEUE_LEN;
+         r++)
+        if ((r->state == REQ_QUEUED || r->state == REQ_ACTIVE) &&
+            r->seq < req->seq && (r->write || req->write) &&
+            r->block_no < req->block_no + req->nblocks &&
+            req->block_no < r->block_no + r->nblocks)
+            return 0;
+    return 1;
+}
 
-#define DATA_PRESENT_FLAG         (1 << 5)
-#define READ_WITH_DMA_ENABLE_MODE ((1 << 4) | (1 << 0))
-    /* Send and wait for a read request with command #17. */
-    offset *= BLOCK_SIZE;
-    sdhci_exec_cmd(17, offset, DATA_PRESENT_FLAG, READ_WITH_DMA_ENABLE_MODE);
+static void sdhci_next() {
+    /* Pick the queued request closest to disk_pos in the forward order. */
+    struct disk_request *req, *first = NULL;
+    for (req = disk_queue; req < disk_queue + DISK_QUEUE_LEN; req++)
+        if (req->state == REQ_QUEUED && disk_ready(req) &&
+            (!first || req->block_no - disk_pos < first->block_no - disk_pos))
+            first = req;
+    if (first == NULL) return;
+
+    /* Merge the queued requests which continue the run of blocks. */
+    adma2_len = 0;
+    adma2_add(first->buf, first->nblocks * BLOCK_SIZE);
+    first->state = REQ_ACTIVE;
+    disk_pos     = first->block_no + first->nblocks;
+    for (uint merged = 1; merged;) {
+        merged = 0;
+        for (req = disk_queue; req < disk_queue + DISK_QUEUE_LEN; req++)
+            if (req->state == REQ_QUEUED && req->write == first->write &&
+                req->block_no == disk_pos && disk_ready(req) &&
+                disk_pos + req->nblocks - first->block_no <=
+                    SDHCI_MAX_NBLOCKS &&
+                adma2_add(req->buf, req->nblocks * BLOCK_SIZE) == 0) {
+                req->state = REQ_ACTIVE;
+                disk_pos += req->nblocks;
+                merged = 1;
+            }
+    }
 
-    memcpy(dst, aligned_buf, BLOCK_SIZE);
+    disk_busy        = 1;
+    disk_cmd_write   = first->write;
+    disk_cmd_nblocks = disk_pos - first->block_no;
+    disk_cmd_start   = mtime_get();
+    sdhci_start(first->block_no, disk_cmd_nblocks, disk_cmd_write);
+}
+
+static void sdhci_finish() {
+    /* Complete the requests in flight and start the next requests. */
+    for (uint i = 0; i < DISK_QUEUE_LEN; i++)
+        if (disk_queue[i].state == REQ_ACTIVE) disk_queue[i].state = REQ_DONE;
+    disk_busy = 0;
+    disk_account(disk_cmd_write, disk_cmd_nblocks, disk_cmd_start);
+    if (!disk_plugged) sdhci_next();
+}
+
+/* The queue and the controller are shared by the processes calling the disk
+ * functions below and by sdhci_intr() in the kernel. Instead of disabling the
+ * interrupts, which a process in user mode cannot do, they hold disk_lock,
+ * and the kernel never preempts a process holding it (see intr_entry() in
+ * grass/kernel.c), so the kernel itself never waits for the lock. When the
+ * lock is held, sdhci_intr() masks the SDHCI interrupt and leaves its work
+ * to disk_unlock(). */
+static uint disk_lock, disk_deferred;
+
+static void sdhci_complete() {
+    if (!(REGW(SDHCI_BASE, SDHCI_INT_STAT) & 0x2)) return;
+    REGW(SDHCI_BASE, SDHCI_INT_STAT) = 0x2;
+    if (disk_busy) sdhci_finish();
+}
+
+static void disk_unlock() {
+    /* Take the lock again if sdhci_intr() is deferred right before release. */
+    do {
+        if (disk_deferred) {
+            disk_deferred = 0;
+            sdhci_complete();
+            REGW(SDHCI_BASE, SDHCI_INT_SIG_ENABLE) = 0x2;
+        }
+        release(disk_lock);
+    } while (disk_deferred && !__sync_lock_test_and_set(&disk_lock, 1));
+}
+
+#define SDHCI_PLIC_IRQ 33
+static void sdhci_intr(uint irq) {
+    if (__sync_lock_test_and_set(&disk_lock, 1)) {
+        REGW(SDHCI_BASE, SDHCI_INT_SIG_ENABLE) = 0x0;
+        disk_deferred = 1;
+        return;
+    }
+    sdhci_complete();
+    disk_unlock();
+}
+
+int disk_locked() { return disk_lock; }
+
+static void sdhci_poll() {
+    /* Start the queued requests if idle, and wait for the command in flight. */
+    if (!disk_busy) sdhci_next();
+    if (!disk_busy) FATAL("sdhci_poll: no request to transfer");
+    sdhci_wait();
+    sdhci_finish();
+}
+
+static void sdhci_sync(uint offset, uint nblocks, char* buf, uint write) {
+    /* The caller holds disk_lock. Mask the SDHCI interrupt while polling. */
+    REGW(SDHCI_BASE, SDHCI_INT_SIG_ENABLE) = 0x0;
+
+    /* Queue the transfer behind the requests submitted before, and poll
+     * until it is done, which may also complete other requests. */
+    struct disk_request* req = NULL;
+    disk_plugged             = 0;
+    while (1) {
+        for (uint i = 0; i < DISK_QUEUE_LEN && !req; i++)
+            if (disk_queue[i].state == REQ_FREE) req = &disk_queue[i];
+        if (req) break;
+        sdhci_poll();
+    }
+    *req = (struct disk_request){REQ_QUEUED, GPID_DISK, offset, nblocks,
+                                 write,      buf,       ++disk_seq};
+    while (req->state != REQ_DONE) sdhci_poll();
+    req->state = REQ_FREE;
+
+    REGW(SDHCI_BASE, SDHCI_INT_SIG_ENABLE) = 0x2;
+}
+
+/* A buffer which is not 4-byte aligned is bounced through sdhci_bounce. */
+#define SDHCI_BOUNCE_NBLOCKS 8
+static char sdhci_bounce[SDHCI_BOUNCE_NBLOCKS * BLOCK_SIZE]
+    __attribute__((aligned(PAGE_SIZE)));
+
+static void sdhci_read(uint offset, uint nblocks, char* dst) {
+    if (((uint)dst & 0x3) == 0) {
+        sdhci_sync(offset, nblocks, dst, 0);
+        return;
+    }
+
+    for (uint n; nblocks; offset += n, nblocks -= n, dst += n * BLOCK_SIZE) {
+        n = (nblocks < SDHCI_BOUNCE_NBLOCKS) ? nblocks : SDHCI_BOUNCE_NBLOCKS;
+        sdhci_sync(offset, n, sdhci_bounce, 0);
+        memcpy(dst, sdhci_bounce, n * BLOCK_SIZE);
+    }
+}
+
+static void sdhci_write(uint offset, uint nblocks, char* src) {
+    if (((uint)src & 0x3) == 0) {
+        sdhci_sync(offset, nblocks, src, 1);
+        return;
+    }
+
+    for (uint n; nblocks; offset += n, nblocks -= n, src += n * BLOCK_SIZE) {
+        n = (nblocks < SDHCI_BOUNCE_NBLOCKS) ? nblocks : SDHCI_BOUNCE_NBLOCKS;
+        memcpy(sdhci_bounce, src, n * BLOCK_SIZE);
+        sdhci_sync(offset, n, sdhci_bounce, 1);
+    }
 }
 
 static int sdhci_init() {
@@ -65,10 +310,16 @@ static int sdhci_init() {
     while (REGB(SDHCI_BASE, SDHCI_SOFTWARE_RESET) & 0x1);
     REGB(SDHCI_BASE, SDHCI_CLKCON) = 0x5;
 
-    /* Enable interrupt status, but disable interrupt signal. */
-    REGW(SDHCI_BASE, SDHCI_INT_SIG_ENABLE)  = 0x0;
+    /* Select the 32-bit ADMA2 mode for DMA. */
+    REGB(SDHCI_BASE, SDHCI_HOST_CONTROL) = (2 << 3);
+
+    /* Enable interrupt status, and signal the transfer complete interrupt
+     * which QEMU routes to PLIC irq #33 (INTA of the PCI slot #1). */
+    REGW(SDHCI_BASE, SDHCI_INT_SIG_ENABLE)  = 0x2;
     REGW(SDHCI_BASE, SDHCI_INT_STAT_ENABLE) = 0x27F003B;
 
+    earth->intr_register(SDHCI_PLIC_IRQ, sdhci_intr);
+
     /* A simplified SDHCI initialization tailored for QEMU. */
     sdhci_exec_cmd(55, 0, 0, 0);
     sdhci_exec_cmd(41, 0xFFF0000, 0, 0);
@@ -111,20 +362,62 @@ static char sdspi_exec_acmd(char* cmd) {
     return sdspi_exec_cmd(cmd);
 }
 
-static void sdspi_read(uint offset, char* dst) {
+static void sdspi_read(uint offset, uint nblocks, char* dst) {
     /* Wait until SD card is ready for a new command. */
     while (spi_exchange(0xFF) != 0xFF);
 
-    /* Send a read request with command #17. */
+    /* Send a read request with command #17, or #18 for multiple blocks. */
     char* arg = (void*)&offset;
-    char reply, cmd17[] = {17 | (1 << 6), arg[3], arg[2], arg[1], arg[0], 0xFF};
-    if (reply = sdspi_exec_cmd(cmd17))
-        FATAL("cmd17 returns status 0x%.2x", reply);
+    char reply, idx = (nblocks > 1) ? 18 : 17;
+    char cmd[] = {idx | (1 << 6), arg[3], arg[2], arg[1], arg[0], 0xFF};
+    if (reply = sdspi_exec_cmd(cmd))
+        FATAL("cmd%d returns status 0x%.2x", idx, reply);
+
+    /* Wait for each data packet and ignore the 2-byte checksum. */
+    for (uint i = 0; i < nblocks; i++, dst += BLOCK_SIZE) {
+        while (spi_exchange(0xFF) != 0xFE);
+        for (uint j = 0; j < BLOCK_SIZE; j++) dst[j] = spi_exchange(0xFF);
+        spi_exchange(0xFF);
+        spi_exchange(0xFF);
+    }
+    if (nblocks == 1) return;
 
-    /* Wait for the data packet and ignore the 2-byte checksum. */
-    while (spi_exchange(0xFF) != 0xFE);
-    for (uint i = 0; i < BLOCK_SIZE; i++) dst[i] = spi_exchange(0xFF);
+    /* Stop the transmission with command #12, skipping the stuff byte
+     * after it and waiting for the reply (the card is busy afterwards). */
+    char cmd12[] = {12 | (1 << 6), 0x00, 0x00, 0x00, 0x00, 0xFF};
+    for (uint i = 0; i < 6; i++) spi_exchange(cmd12[i]);
     spi_exchange(0xFF);
+    for (uint i = 0; i < 8 && (spi_exchange(0xFF) & 0x80); i++);
+}
+
+static void sdspi_write(uint offset, uint nblocks, char* src) {
+    /* Wait until SD card is ready for a new command. */
+    while (spi_exchange(0xFF) != 0xFF);
+
+    /* Send a write request with command #24, or #25 for multiple blocks. */
+    char* arg = (void*)&offset;
+    char reply, idx = (nblocks > 1) ? 25 : 24;
+    char cmd[] = {idx | (1 << 6), arg[3], arg[2], arg[1], arg[0], 0xFF};
+    if (reply = sdspi_exec_cmd(cmd))
+        FATAL("cmd%d returns status 0x%.2x", idx, reply);
+
+    /* Send each data packet with a dummy checksum after the card finishes
+     * programming the previous one, and check the data response token. */
+    char token = (nblocks > 1) ? 0xFC : 0xFE;
+    for (uint i = 0; i < nblocks; i++, src += BLOCK_SIZE) {
+        while (spi_exchange(0xFF) != 0xFF);
+        spi_exchange(token);
+        for (uint j = 0; j < BLOCK_SIZE; j++) spi_exchange(src[j]);
+        spi_exchange(0xFF);
+        spi_exchange(0xFF);
+        if ((reply = spi_exchange(0xFF) & 0x1F) != 0x05)
+            FATAL("SD card rejects block %d with 0x%.2x", offset + i, reply);
+    }
+
+    /* Stop the transmission with the stop token of command #25. */
+    if (nblocks == 1) return;
+    while (spi_exchange(0xFF) != 0xFF);
+    spi_exchange(0xFD);
     spi_exchange(0xFF);
 }
 
@@ -167,44 +460,220 @@ static int sdspi_init() {
 
 static enum disk_type { SD_CARD, FLASH_ROM } type;
 
-void disk_read(uint block_no, uint nblocks, char* dst) {
+/* With RAMDISK=1 or 2 (see Makefile), disk_init() loads the file system into
+ * the memory beyond RAM_END on QEMU, which serves the later reads. RAMDISK=1
+ * writes through to the disk, while RAMDISK=2 keeps the written blocks dirty
+ * in the memory until disk_flush() writes them back. */
+#ifndef RAMDISK
+#define RAMDISK 0
+#endif
+#define RAM_DISK_NBLOCKS (FILE_SYS_DISK_SIZE / BLOCK_SIZE)
+static uint ramdisk_ready, ramdisk_dirty[RAM_DISK_NBLOCKS / 32];
+
+static char* ramdisk_map(uint block_no, uint nblocks) {
+    if (!ramdisk_ready || block_no < FILE_SYS_DISK_START ||
+        block_no + nblocks > FILE_SYS_DISK_START + RAM_DISK_NBLOCKS)
+        return NULL;
+    return (char*)RAM_DISK_BASE + (block_no - FILE_SYS_DISK_START) * BLOCK_SIZE;
+}
+
+static void disk_read_locked(uint block_no, uint nblocks, char* dst) {
+    char* ram = ramdisk_map(block_no, nblocks);
+    if (ram) {
+        memcpy(dst, ram, nblocks * BLOCK_SIZE);
+        return;
+    }
+
+    /* The CPU is busy during the whole synchronous read. */
+    ulonglong start = mtime_get();
     if (type == FLASH_ROM) {
         char* src = (char*)FLASH_ROM_BASE + block_no * BLOCK_SIZE;
         memcpy(dst, src, nblocks * BLOCK_SIZE);
+        disk_account(0, nblocks, start);
+        iostat.poll_usec += (mtime_get() - start) / MTIME_PER_USEC;
         return;
     }
 
     /* Student's code goes here (Serial Device Driver). */
 
-    /* Replace the loop below by reading multiple SD card
-     * blocks altogether using the SD card command #18. */
-    for (uint i = 0; i < nblocks; i++)
-        (earth->platform == HARDWARE)
-            ? sdspi_read(block_no + i, dst + BLOCK_SIZE * i)
-            : sdhci_read(block_no + i, dst + BLOCK_SIZE * i);
+    /* Read multiple SD card blocks altogether using command #18. */
+    while (nblocks) {
+        uint n = nblocks;
+        if (earth->platform == HARDWARE) {
+            ulonglong cmd_start = mtime_get();
+            sdspi_read(block_no, n, dst);
+            disk_account(0, n, cmd_start);
+        } else {
+            /* SDHCI reads at most one descriptor table with a command. */
+            if (n > SDHCI_MAX_NBLOCKS) n = SDHCI_MAX_NBLOCKS;
+            sdhci_read(block_no, n, dst);
+        }
+        block_no += n;
+        nblocks -= n;
+        dst += n * BLOCK_SIZE;
+    }
 
     /* Student's code ends here. */
+    iostat.poll_usec += (mtime_get() - start) / MTIME_PER_USEC;
 }
 
-void disk_write(uint block_no, uint nblocks, char* src) {
+static void disk_write_below(uint block_no, uint nblocks, char* src) {
+    /* Write to the disk, bypassing the RAM disk. */
     if (type == FLASH_ROM) FATAL("FLASH_ROM is read only");
+    ulonglong start = mtime_get();
     /* Student's code goes here (Serial Device Driver). */
 
-    /* Implement SD card write using SPI or SDHCI+PCI. */
+    /* Write multiple SD card blocks altogether using command #25. */
+    while (nblocks) {
+        uint n = nblocks;
+        if (earth->platform == HARDWARE) {
+            ulonglong cmd_start = mtime_get();
+            sdspi_write(block_no, n, src);
+            disk_account(1, n, cmd_start);
+        } else {
+            /* SDHCI writes at most one descriptor table with a command. */
+            if (n > SDHCI_MAX_NBLOCKS) n = SDHCI_MAX_NBLOCKS;
+            sdhci_write(block_no, n, src);
+        }
+        block_no += n;
+        nblocks -= n;
+        src += n * BLOCK_SIZE;
+    }
 
     /* Student's code ends here. */
+    iostat.poll_usec += (mtime_get() - start) / MTIME_PER_USEC;
+}
+
+static void disk_write_locked(uint block_no, uint nblocks, char* src) {
+    char* ram = ramdisk_map(block_no, nblocks);
+    if (ram) {
+        memcpy(ram, src, nblocks * BLOCK_SIZE);
+        if (RAMDISK == 2) {
+            uint i = block_no - FILE_SYS_DISK_START;
+            for (uint j = i; j < i + nblocks; j++)
+                ramdisk_dirty[j / 32] |= (1 << (j % 32));
+            return;
+        }
+    }
+    disk_write_below(block_no, nblocks, src);
+}
+
+void disk_read(uint block_no, uint nblocks, char* dst) {
+    acquire(disk_lock);
+    disk_read_locked(block_no, nblocks, dst);
+    disk_unlock();
+}
+
+void disk_write(uint block_no, uint nblocks, char* src) {
+    acquire(disk_lock);
+    disk_write_locked(block_no, nblocks, src);
+    disk_unlock();
+}
+
+int disk_submit(int pid, uint block_no, uint nblocks, char* buf,
+                uint flags) {
+    /* Queue the request with disk_lock held. A request without any blocks
+     * only releases the requests held by DISK_PLUG. */
+    uint depth               = 0;
+    struct disk_request* req = NULL;
+    acquire(disk_lock);
+    for (uint i = 0; i < DISK_QUEUE_LEN; i++) {
+        if (disk_queue[i].state == REQ_FREE) req = &disk_queue[i];
+        if (disk_queue[i].state != REQ_FREE && disk_queue[i].pid == pid)
+            depth++;
+    }
+
+    int ret = -1;
+    if (nblocks > DISK_MAX_NBLOCKS) FATAL("disk_submit: too many blocks");
+    if (nblocks && req && depth < DISK_CLIENT_DEPTH) {
+        *req = (struct disk_request){REQ_QUEUED, pid, block_no, nblocks,
+                                     flags & DISK_WRITE, buf, ++disk_seq};
+        ret  = 0;
+    }
+
+    /* Without the disk interrupt, complete the request right away, and so
+     * for a buffer which ADMA2 cannot use (see sdhci_read). */
+    if (ret == 0 && (type == FLASH_ROM || earth->platform == HARDWARE ||
+                     ramdisk_map(block_no, nblocks) || ((uint)buf & 0x3))) {
+        req->write ? disk_write_locked(block_no, nblocks, buf)
+                   : disk_read_locked(block_no, nblocks, buf);
+        req->state = REQ_DONE;
+    }
+
+    /* Hold the queue for requests to merge, unless the process is full. */
+    disk_plugged = (ret == 0) && (flags & DISK_PLUG);
+    if (!disk_busy && !disk_plugged && earth->platform == QEMU) sdhci_next();
+    disk_unlock();
+    return ret;
+}
+
+int disk_complete(int pid) {
+    /* Consume a completed request of pid if any. This runs in the kernel,
+     * which never preempts a process holding disk_lock. */
+    for (uint i = 0; i < DISK_QUEUE_LEN; i++)
+        if (disk_queue[i].state == REQ_DONE && disk_queue[i].pid == pid) {
+            disk_queue[i].state = REQ_FREE;
+            return 1;
+        }
+    return 0;
+}
+
+void disk_stat(struct disk_stat* stat) { *stat = iostat; }
+
+void disk_flush() {
+    if (!ramdisk_ready) return;
+
+    /* Write back each run of dirty blocks with one command, holding
+     * disk_lock for one run at a time. */
+    for (uint i = 0, n; i < RAM_DISK_NBLOCKS; i += n ? n : 1) {
+        acquire(disk_lock);
+        for (n = 0; i + n < RAM_DISK_NBLOCKS; n++) {
+            uint j = i + n;
+            if (!(ramdisk_dirty[j / 32] & (1 << (j % 32)))) break;
+            ramdisk_dirty[j / 32] &= ~(1 << (j % 32));
+        }
+        if (n) disk_write_below(FILE_SYS_DISK_START + i, n,
+                                (char*)RAM_DISK_BASE + i * BLOCK_SIZE);
+        disk_unlock();
+    }
+}
+
+char* disk_map(uint block_no) {
+    /* The flash ROM holds the same executables as the disk (see mkfs.c),
+     * and it holds the whole disk except the swap area if it is the disk. */
+    char* ram    = ramdisk_map(block_no, 1);
+    uint nblocks = (type == FLASH_ROM) ? SWAP_DISK_START : FILE_SYS_DISK_START;
+    if (ram) return ram;
+    return block_no < nblocks ? (char*)FLASH_ROM_BASE + block_no * BLOCK_SIZE
+                              : NULL;
 }
 
 void disk_init() {
     earth->disk_read  = disk_read;
     earth->disk_write = disk_write;
+    earth->disk_map   = disk_map;
+
+    earth->disk_submit   = disk_submit;
+    earth->disk_complete = disk_complete;
+    earth->disk_stat     = disk_stat;
+    earth->disk_flush    = disk_flush;
+    earth->disk_locked   = disk_locked;
 
     if (earth->platform == QEMU) {
         /* QEMU uses the PCI bus and the SDHCI standard. */
         sdhci_init();
+        if (RAMDISK) {
+            /* QEMU has 8MB of memory (see Makefile), 2MB beyond RAM_END. */
+            INFO("Load the file system into the RAM disk at 0x%x",
+                 RAM_DISK_BASE);
+            disk_read(FILE_SYS_DISK_START, RAM_DISK_NBLOCKS,
+                      (char*)RAM_DISK_BASE);
+            ramdisk_ready = 1;
+        }
     } else {
         /* Hardware uses the SPI bus to control SD card. */
         type = (sdspi_init() == 0) ? SD_CARD : FLASH_ROM;
         if (type == FLASH_ROM) CRITICAL("Using FLASH_ROM instead of SD_CARD");
     }
+    earth->disk_readonly = (type == FLASH_ROM);
 }
@@ -9,8 +9,12 @@
 #include "process.h"
 #include "elf.h"
 
-static void sys_proc_read(uint block_no, char* dst) {
-    earth->disk_read(SYS_PROC_EXEC_START + block_no, 1, dst);
+static void sys_proc_read(uint block_no, uint nblocks, char* dst) {
+    earth->disk_read(SYS_PROC_EXEC_START + block_no, nblocks, dst);
+}
+
+static char* sys_proc_map(uint block_no) {
+    return earth->disk_map(SYS_PROC_EXEC_START + block_no);
 }
 
 void grass_entry(uint core_id) {
@@ -20,6 +24,7 @@ void grass_entry(uint core_id) {
     grass->proc_free      = proc_free;
     grass->proc_alloc     = proc_alloc;
     grass->proc_set_ready = proc_set_ready;
+    grass->proc_clone     = proc_clone;
     grass->sys_send       = sys_send;
     grass->sys_recv       = sys_recv;
     /* Student's code goes here (System Call | Multicore & Locks). */
@@ -30,7 +35,7 @@ void grass_entry(uint core_id) {
 
     /* Load GPID_PROCESS. */
     INFO("Load kernel process #%d: sys_process", GPID_PROCESS);
-    elf_load(GPID_PROCESS, sys_proc_read, 0, 0);
+    elf_load(GPID_PROCESS, sys_proc_read, sys_proc_map, 0, 0);
     proc_set_running(proc_alloc());
     core_to_proc_idx[core_id] = 1; /* See proc_alloc() for why. */
     earth->mmu_switch(GPID_PROCESS);
@@ -43,6 +48,10 @@ void grass_entry(uint core_id) {
     mstatus = (mstatus & ~(3 << 11)) | (GRASS_MODE << 11);
     asm("csrw mstatus, %0" ::"r"(mstatus));
 
+    /* Take the external interrupts (e.g., of the disk) from now on, since
+     * the kernel is ready to handle them (see intr_entry() in kernel.c). */
+    if (earth->platform == QEMU) asm("csrs mie, %0" ::"r"(0x800));
+
     asm("csrw mepc, %0" ::"r"(APPS_ENTRY));
     asm("mv a0, %0" ::"r"(APPS_ARG));
     asm("mv a1, %0" ::"r"(&boot_lock));
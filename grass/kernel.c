@@ -40,9 +40,10 @@ void kernel_entry() {
     memcpy(SAVED_REGISTER_ADDR, curr_saved, SAVED_REGISTER_SIZE);
 }
 
-#define INTR_ID_TIMER   7
-#define EXCP_ID_ECALL_U 8
-#define EXCP_ID_ECALL_M 11
+#define INTR_ID_TIMER    7
+#define INTR_ID_EXTERNAL 11
+#define EXCP_ID_ECALL_U  8
+#define EXCP_ID_ECALL_M  11
 static void proc_yield();
 static void proc_try_syscall(struct process* proc);
 
@@ -75,6 +76,20 @@ static void excp_entry(uint id) {
 }
 
 static void intr_entry(uint id) {
+    /* Let the process holding the disk lock run until it releases the lock
+     * (see earth/dev_disk.c), so that the kernel never waits for the lock. */
+    if (earth->disk_locked()) {
+        if (id == INTR_ID_EXTERNAL) earth->intr_dispatch(core_in_kernel);
+        if (id == INTR_ID_TIMER) earth->timer_reset(core_in_kernel);
+        return;
+    }
+
+    if (id == INTR_ID_EXTERNAL) {
+        /* A device (e.g., the disk) may have woken up a waiting process. */
+        earth->intr_dispatch(core_in_kernel);
+        proc_yield();
+        return;
+    }
     if (id != INTR_ID_TIMER) FATAL("excp_entry: kernel got interrupt %d", id);
     /* Student's code goes here (Preemptive Scheduler). */
 
@@ -234,6 +249,14 @@ static void proc_yield() {
     earth->timer_reset(core_in_kernel);
 }
 
+/* Granted pages must be page-aligned and within the code, data and heap of
+ * an app, excluding the pages of APPS_ARG, SYSCALL_ARG and SHELL_WORK_DIR,
+ * the shared library and the stack. */
+static int grant_valid(uint vaddr, uint npages) {
+    return (vaddr % GRANT_PAGE_SIZE) == 0 && npages <= GRANT_MAX_NPAGES &&
+           vaddr >= APPS_ENTRY && vaddr + npages * GRANT_PAGE_SIZE <= APPS_ARG;
+}
+
 static void proc_try_send(struct process* sender) {
     for (uint i = 0; i < MAX_NPROCESS; i++) {
         struct process* dst = &proc_set[i];
@@ -246,12 +269,31 @@ static void proc_try_send(struct process* sender) {
             if (!(dst->syscall.sender == GPID_ALL ||
                   dst->syscall.sender == sender->pid))
                 return;
-
             dst->syscall.status = DONE;
             dst->syscall.sender = sender->pid;
             /* Copy the system call arguments within the kernel PCB. */
             memcpy(dst->syscall.content, sender->syscall.content,
                    SYSCALL_MSG_LEN);
+
+            /* Move the granted pages from sender to dst by remapping. */
+            uint npages               = sender->syscall.grant_npages;
+            uint window               = dst->syscall.grant_npages;
+            dst->syscall.grant_npages = 0;
+            if (npages && (npages > window ||
+                           !grant_valid(sender->syscall.grant_vaddr, npages) ||
+                           !grant_valid(dst->syscall.grant_vaddr, npages)))
+                dst->syscall.grant_npages = GRANT_ERROR;
+            else if (npages)
+                dst->syscall.grant_npages = earth->mmu_grant(
+                    sender->pid, sender->syscall.grant_vaddr, dst->pid,
+                    dst->syscall.grant_vaddr, npages);
+
+            /* Tell the sender how many pages have been granted. */
+            if (npages) {
+                uint paddr = earth->mmu_translate(sender->pid, SYSCALL_ARG);
+                ((struct syscall*)paddr)->grant_npages =
+                    dst->syscall.grant_npages;
+            }
             return;
         }
     }
@@ -259,6 +301,11 @@ static void proc_try_send(struct process* sender) {
 }
 
 static void proc_try_recv(struct process* receiver) {
+    /* GPID_DISK sends an empty message when a disk request completes. */
+    if (receiver->syscall.sender == GPID_DISK &&
+        receiver->syscall.status == PENDING &&
+        earth->disk_complete(receiver->pid))
+        receiver->syscall.status = DONE;
     if (receiver->syscall.status == PENDING) return;
 
     /* Copy the system call struct from the kernel back to user space. */
@@ -8,6 +8,7 @@
 #include "process.h"
 #include "egos.h"
 #include <stdio.h>
+#include <string.h>
 
 #define MLFQ_NLEVELS          5
 #define MLFQ_RESET_PERIOD     10000000         /* 10 seconds */
@@ -83,6 +84,33 @@ void proc_set_pending(int pid) {
     }
 }
 
+int proc_clone(int ppid, int pid) {
+    struct process *parent = NULL, *child = NULL;
+    for (uint i = 0; i <= MAX_NPROCESS; i++) {
+        if (proc_set[i].pid == ppid) parent = &proc_set[i];
+        if (proc_set[i].pid == pid) child = &proc_set[i];
+    }
+
+    /* Only clone a parent inside fork(), i.e., either waiting for the reply
+     * of PROC_FORK or having just sent PROC_FORK to GPID_PROCESS. */
+    struct syscall* sc = &parent->syscall;
+    int waiting = (parent->status == PROC_PENDING_SYSCALL &&
+                   sc->type == SYS_RECV && sc->sender == GPID_PROCESS);
+    int sent    = (parent->status == PROC_RUNNABLE && sc->type == SYS_SEND &&
+                sc->receiver == GPID_PROCESS &&
+                ((struct proc_request*)sc->content)->type == PROC_FORK);
+    if (!waiting && !sent) return -1;
+
+    /* The child continues from where the parent is, e.g., waiting for
+     * the reply of PROC_FORK from GPID_PROCESS. */
+    child->mepc = parent->mepc;
+    memcpy(&child->syscall, &parent->syscall, sizeof(struct syscall));
+    memcpy(child->saved_registers, parent->saved_registers,
+           SAVED_REGISTER_SIZE);
+    child->status = waiting ? PROC_PENDING_SYSCALL : PROC_RUNNABLE;
+    return 0;
+}
+
 int proc_alloc() {
     static uint curr_pid = 0;
     for (uint i = 1; i <= MAX_NPROCESS; i++)
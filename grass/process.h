@@ -56,6 +56,7 @@ void proc_set_ready(int);
 void proc_set_running(int);
 void proc_set_runnable(int);
 void proc_set_pending(int);
+int proc_clone(int, int);
 
 void mlfq_reset_level();
 void mlfq_update_level(struct process* p, unsigned long long runtime);
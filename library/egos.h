@@ -5,11 +5,34 @@ typedef unsigned short ushort;
 typedef unsigned int uint;
 typedef unsigned long long ulonglong;
 
+struct mmu_stat {
+    int pid;
+    uint resident;  /* # private pages in memory   */
+    uint pagetable; /* # pages holding page tables */
+    uint shared;    /* # pages shared after fork() */
+    uint swapped;   /* # pages in the swap area    */
+};
+
+#define DISK_LAT_CNT 16
+struct disk_stat {
+    uint cmds[2];               /* # commands reading [0] and writing [1]  */
+    uint blocks[2];             /* # blocks read [0] and written [1]       */
+    uint latency[DISK_LAT_CNT]; /* # commands taking [2^i, 2^(i+1)) usec   */
+    ulonglong busy_usec;        /* time with a disk command in flight      */
+    ulonglong poll_usec;        /* time of the CPU spinning for the disk   */
+};
+
 struct earth {
     uint (*mmu_alloc)();
     void (*mmu_free)(int pid);
+    void (*mmu_fork)(int ppid, int pid);
+    uint (*mmu_grant)(int from, uint from_vaddr, int to, uint to_vaddr,
+                      uint npages);
+    uint (*mmu_stat)(struct mmu_stat* stats, uint n);
     void (*mmu_flush_cache)();
     void (*timer_reset)(uint core_id);
+    void (*intr_register)(uint irq, void (*handler)(uint irq));
+    void (*intr_dispatch)(uint core_id);
 
     void (*mmu_map)(int pid, uint vpage_no, uint ppage_id);
     uint (*mmu_translate)(int pid, uint vaddr);
@@ -20,15 +43,24 @@ struct earth {
     uint (*tty_input_empty)();
     void (*disk_read)(uint block_no, uint nblocks, char* dst);
     void (*disk_write)(uint block_no, uint nblocks, char* src);
+    char* (*disk_map)(uint block_no);
+    int (*disk_submit)(int pid, uint block_no, uint nblocks, char* buf,
+                       uint flags);
+    int (*disk_complete)(int pid);
+    void (*disk_stat)(struct disk_stat* stat);
+    void (*disk_flush)();
+    int (*disk_locked)();
 
     enum { HARDWARE, QEMU } platform;
     enum { PAGE_TABLE, SOFT_TLB } translation;
+    int disk_readonly; /* set by earth/dev_disk.c when using the flash ROM */
 };
 
 struct grass {
     int (*proc_alloc)();
     void (*proc_free)(int pid);
     void (*proc_set_ready)(int pid);
+    int (*proc_clone)(int ppid, int pid);
 
     void (*sys_send)(int receiver, char* msg, uint size);
     void (*sys_recv)(int from, int* sender, char* buf, uint size);
@@ -43,9 +75,12 @@ extern struct earth* earth;
 extern struct grass* grass;
 
 /* Below is the physical memory layout in egos-2000. */
+#define RAM_DISK_BASE     0x80600000 /* 2MB RAM disk on QEMU (RAMDISK)      */
 #define RAM_END           0x80600000 /* 6MB memory [0x80000000,0x80600000)  */
 #define APPS_PAGES_BASE   0x80400000 /* 2MB free for mmu_alloc              */
-#define APPS_STACK_TOP    0x80400000 /* 1MB app stack (growing down)        */
+#define APPS_STACK_TOP    0x80400000 /* 64KB app stack (growing down)       */
+#define APPS_STACK_LIMIT  0x803F0000 /* lowest address of the app stack     */
+#define APPS_LIB_BASE     0x80380000 /* 448KB shared C library (lib.lds)    */
 #define SHELL_WORK_DIR    0x80302000 /* current work directory for shell    */
 #define SYSCALL_ARG       0x80301000 /* struct syscall                      */
 #define APPS_ARG          0x80300000 /* main() arguments (argc and argv)    */
@@ -58,6 +93,7 @@ extern struct grass* grass;
 /* Below is the memory-mapped I/O layout in egos-2000. */
 #define SDHCI_PCI_ECAM   0x30008000 /* QEMU */
 #define SDHCI_BASE       0x40000000 /* QEMU */
+#define PLIC_BASE        0x0C000000 /* QEMU */
 #define SDSPI_BASE       0xF0008800 /* Hardware */
 #define NIC_PCI_ECAM     0x30018000 /* QEMU */
 #define NIC_RX_BUFFER    0x90000000 /* Hardware */
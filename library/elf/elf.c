@@ -14,46 +14,118 @@
 #define PAGE_SIZE          4096
 #define PAGE_ID_TO_ADDR(x) ((char*)APPS_PAGES_BASE + x * PAGE_SIZE)
 
-void elf_load(int pid, elf_reader reader, int argc, void** argv) {
+/* Decode len bytes at src in the LZ4 block format (see tools/mkfs.c). */
+static void lz4_decode(uchar* src, uint len, uchar* dst) {
+    for (uchar* end = src + len; src < end;) {
+        uint token = *src++, n = token >> 4;
+        if (n == 15) do n += *src; while (*src++ == 255);
+        memcpy(dst, src, n);
+        dst += n;
+        src += n;
+        if (src >= end) break;
+
+        /* Copy n bytes from offset bytes ago, which may overlap with dst. */
+        uint offset = src[0] | (src[1] << 8);
+        src += 2;
+        n = (token & 15) + 4;
+        if (n == 19) do n += *src; while (*src++ == 255);
+        for (; n; n--, dst++) *dst = *(dst - offset);
+    }
+}
+
+static char* stage_alloc() {
+    /* Give the staging page to GPID_ELF_STAGE, a pid that never runs, rather
+     * than the process being loaded, so that mmu_free releases it after. */
+    uint ppage_id = earth->mmu_alloc();
+    earth->mmu_map(GPID_ELF_STAGE, 0, ppage_id);
+    return PAGE_ID_TO_ADDR(ppage_id);
+}
+
+static char* elf_map(elf_mapper mapper, uint block_no, uint nblocks) {
+    /* Return the blocks in memory-mapped ROM, or NULL if any is not. */
+    return (mapper && mapper(block_no + nblocks - 1)) ? mapper(block_no) : NULL;
+}
+
+int elf_load_segments(int pid, elf_reader reader, elf_mapper mapper) {
     /* Load the ELF header. */
-    char hbuf[BLOCK_SIZE], buf[BLOCK_SIZE];
-    reader(0, hbuf);
+    char hbuf[BLOCK_SIZE];
+    reader(0, 1, hbuf);
     struct elf32_header* header          = (void*)hbuf;
     struct elf32_program_header* pheader = (void*)(hbuf + header->e_phoff);
+    if (memcmp(header->e_ident, "\x7f" "ELF", 4) || header->e_phnum == 0 ||
+        header->e_phoff + header->e_phnum * sizeof(*pheader) > BLOCK_SIZE)
+        return -1;
 
     /* Load the code and data memory regions. */
+    uint npages = 0;
+    char* stage = NULL;
     for (uint i = 0; i < header->e_phnum; i++) {
         uint addr = pheader[i].p_vaddr;
         if (addr < RAM_START) continue;
 
         uint memsz        = pheader[i].p_memsz;
         uint filesz       = pheader[i].p_filesz;
+        /* No segment may overlap the app stack set up by elf_load_args. */
+        if (addr < APPS_STACK_TOP && addr + memsz > APPS_STACK_LIMIT)
+            return -1;
         uint curr_pageno  = addr / PAGE_SIZE;
-        uint end_pageno   = (addr + memsz) / PAGE_SIZE;
+        uint end_pageno   = (addr + memsz + PAGE_SIZE - 1) / PAGE_SIZE;
         uint curr_blockno = pheader[i].p_offset / BLOCK_SIZE;
-        for (uint ppage_id, off = 0; off < filesz; off += BLOCK_SIZE) {
-            /* Allocate one page (4KB) for every 8 blocks (512 bytes). */
-            if (off % PAGE_SIZE == 0) {
-                ppage_id = earth->mmu_alloc();
-                earth->mmu_map(pid, curr_pageno++, ppage_id);
-                memset(PAGE_ID_TO_ADDR(ppage_id), 0, PAGE_SIZE);
-            }
-            uint size =
-                (off + BLOCK_SIZE < filesz) ? BLOCK_SIZE : (filesz - off);
-            reader(curr_blockno++, buf);
-            memcpy(PAGE_ID_TO_ADDR(ppage_id) + (off % PAGE_SIZE), buf, size);
-        }
 
-        while (curr_pageno < end_pageno) {
+        /* A compressed segment starts with a block holding the compressed
+         * size of every page, or 0 for a page stored as it is. */
+        ushort clen[BLOCK_SIZE / sizeof(ushort)];
+        uint compressed = pheader[i].p_flags & PF_EGOS_LZ4;
+        if (compressed) reader(curr_blockno++, 1, (void*)clen);
+
+        for (uint k = 0; curr_pageno < end_pageno; k++) {
+            uint off      = k * PAGE_SIZE;
             uint ppage_id = earth->mmu_alloc();
+            char* page    = PAGE_ID_TO_ADDR(ppage_id);
             earth->mmu_map(pid, curr_pageno++, ppage_id);
-            memset(PAGE_ID_TO_ADDR(ppage_id), 0, PAGE_SIZE);
+
+            /* Read the blocks of a page (4KB) directly into the page with
+             * one call, or copy them from memory-mapped ROM if possible, and
+             * clear the rest of the page beyond filesz. */
+            uint size = (off >= filesz)              ? 0
+                        : (filesz - off < PAGE_SIZE) ? filesz - off
+                                                     : PAGE_SIZE;
+            if (size && compressed && clen[k]) {
+                /* Decompress from ROM, or else from a staging page given by
+                 * mmu_alloc, so that GPID_FILE can also read into it. */
+                uint nblocks = (clen[k] + BLOCK_SIZE - 1) / BLOCK_SIZE;
+                char* src    = elf_map(mapper, curr_blockno, nblocks);
+                if (!src) {
+                    if (!stage) stage = stage_alloc();
+                    reader(curr_blockno, nblocks, src = stage);
+                }
+                lz4_decode((void*)src, clen[k], (void*)page);
+                curr_blockno += nblocks;
+            } else if (size) {
+                uint nblocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+                char* src    = elf_map(mapper, curr_blockno, nblocks);
+                if (src) {
+                    memcpy(page, src, nblocks * BLOCK_SIZE);
+                } else {
+                    reader(curr_blockno, nblocks, page);
+                }
+                curr_blockno += nblocks;
+            }
+            memset(page + size, 0, PAGE_SIZE - size);
+            npages++;
         }
 
         /* Numbers printed should match the numbers in build/debug/sys_*.lst. */
-        if (pid <= GPID_SHELL) INFO("Load 0x%x bytes to 0x%x", filesz, addr);
+        if (pid >= GPID_PROCESS && pid <= GPID_SHELL)
+            INFO("Load 0x%x bytes to 0x%x", filesz, addr);
     }
 
+    /* Free the staging page before another process may reuse its frame. */
+    if (stage) earth->mmu_free(GPID_ELF_STAGE);
+    return npages;
+}
+
+void elf_load_args(int pid, int argc, void** argv) {
     /* Setup a page for main() arguments (argc and argv). */
     uint ppage_id = earth->mmu_alloc();
     earth->mmu_map(pid, APPS_ARG / PAGE_SIZE, ppage_id);
@@ -73,9 +145,16 @@ void elf_load(int pid, elf_reader reader, int argc, void** argv) {
     ppage_id = earth->mmu_alloc();
     earth->mmu_map(pid, SYSCALL_ARG / PAGE_SIZE, ppage_id);
 
-    /* Setup 2 pages for user stack (enough for teaching purpose). */
+    /* Setup 2 pages for user stack (enough for teaching purpose). The stack
+     * may grow down to APPS_STACK_LIMIT, above the shared C library. */
     for (uint i = 1; i <= 2; i++) {
         ppage_id = earth->mmu_alloc();
         earth->mmu_map(pid, APPS_STACK_TOP / PAGE_SIZE - i, ppage_id);
     }
 }
+
+void elf_load(int pid, elf_reader reader, elf_mapper mapper, int argc,
+              void** argv) {
+    elf_load_segments(pid, reader, mapper);
+    elf_load_args(pid, argc, argv);
+}
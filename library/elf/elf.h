@@ -17,6 +17,11 @@ struct elf32_header {
     ushort e_shstrndx;
 };
 
+#define PT_LOAD 1
+
+/* A segment with this OS-specific flag is compressed by tools/mkfs.c. */
+#define PF_EGOS_LZ4 0x00100000
+
 struct elf32_program_header {
     uint p_type;
     uint p_offset;
@@ -28,5 +33,14 @@ struct elf32_program_header {
     uint p_align;
 };
 
-typedef void (*elf_reader)(uint block_no, char* dst);
-void elf_load(int pid, elf_reader reader, int argc, void** argv);
+/* An elf_reader reads nblocks blocks of the executable to dst in memory. */
+typedef void (*elf_reader)(uint block_no, uint nblocks, char* dst);
+/* An elf_mapper returns the address of a block of the executable in
+ * memory-mapped ROM, or NULL if the block is not in such a ROM. */
+typedef char* (*elf_mapper)(uint block_no);
+
+void elf_load(int pid, elf_reader reader, elf_mapper mapper, int argc,
+              void** argv);
+/* elf_load_segments returns the # pages loaded, or -1 if not an ELF file. */
+int elf_load_segments(int pid, elf_reader reader, elf_mapper mapper);
+void elf_load_args(int pid, int argc, void** argv);
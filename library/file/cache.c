@@ -0,0 +1,264 @@
+/*
+ * (C) 2025, Cornell University
+ * All rights reserved.
+ *
+ * Description: a write-back block cache as an inode store
+ * cachedisk_init() stacks a cache of nblocks blocks on another inode store,
+ * just like treedisk_init() stacks a file system on the disk. A read hit and
+ * a write are served by the cache, and a dirty block is written to the inode
+ * store below when it is evicted or when cachedisk_flush() is called.
+ *
+ * A dirty block is written back together with the dirty blocks continuing
+ * its run in the same inode, up to CACHE_RUN_NBLOCKS blocks with one call of
+ * inode_write_range() below, so that the disk writes the run with one command.
+ *
+ * The victim of eviction is chosen by the CLOCK algorithm. The hand sweeps
+ * over the blocks, clears the reference bit set by the last access of each
+ * block, and takes the first block whose reference bit is already clear.
+ */
+
+#ifdef MKFS
+#include <stdio.h>
+#include <sys/types.h>
+#else
+#include "egos.h"
+#endif
+
+#include "inode.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_RUN_NBLOCKS 8
+
+struct cache_entry {
+    uint ino, offset;       /* the block cached in this entry */
+    uint valid, dirty, ref; /* ref is the reference bit of CLOCK */
+};
+
+struct cachedisk_state {
+    inode_intf below;            /* inode store below */
+    block_t* blocks;             /* the cached blocks */
+    struct cache_entry* entries; /* the entry of each cached block */
+    uint nblocks, hand;          /* the number of entries, the CLOCK hand */
+    uint direct;                 /* see cachedisk_direct() */
+    struct cache_stat stat;      /* the counters of hits and misses */
+    block_t* run;                /* CACHE_RUN_NBLOCKS blocks to write back */
+};
+
+static struct cache_entry* cache_lookup(struct cachedisk_state* cs, uint ino,
+                                        uint offset) {
+    for (uint i = 0; i < cs->nblocks; i++) {
+        struct cache_entry* e = &cs->entries[i];
+        if (e->valid && e->ino == ino && e->offset == offset) return e;
+    }
+    return NULL;
+}
+
+static struct cache_entry* cache_dirty(struct cachedisk_state* cs, uint ino,
+                                       uint offset) {
+    struct cache_entry* e = cache_lookup(cs, ino, offset);
+    return (e && e->dirty) ? e : NULL;
+}
+
+static int cache_writeback(struct cachedisk_state* cs, struct cache_entry* e) {
+    /* Extend the run of dirty blocks around e both ways, and write it. */
+    uint first = e->offset, end = e->offset + 1;
+    while (first > 0 && end - first < CACHE_RUN_NBLOCKS &&
+           cache_dirty(cs, e->ino, first - 1))
+        first--;
+    while (end - first < CACHE_RUN_NBLOCKS && cache_dirty(cs, e->ino, end))
+        end++;
+
+    for (uint i = first; i < end; i++) {
+        struct cache_entry* d = cache_dirty(cs, e->ino, i);
+        memcpy(&cs->run[i - first], &cs->blocks[d - cs->entries], BLOCK_SIZE);
+    }
+    if (inode_write_range(cs->below, e->ino, first, end - first, cs->run) < 0)
+        return -1;
+
+    for (uint i = first; i < end; i++) cache_dirty(cs, e->ino, i)->dirty = 0;
+    cs->stat.writebacks += end - first;
+    return 0;
+}
+
+static struct cache_entry* cache_evict(struct cachedisk_state* cs) {
+    /* Give every referenced block a second chance; see the top comment. */
+    while (1) {
+        struct cache_entry* e = &cs->entries[cs->hand];
+        cs->hand              = (cs->hand + 1) % cs->nblocks;
+        if (e->valid && e->ref) {
+            e->ref = 0;
+            continue;
+        }
+
+        if (e->valid && e->dirty && cache_writeback(cs, e) < 0) return NULL;
+        e->valid = 0;
+        return e;
+    }
+}
+
+static int cachedisk_getsize(inode_intf self, uint ino) {
+    struct cachedisk_state* cs = self->state;
+    return cs->below->getsize(cs->below, ino);
+}
+
+static int cachedisk_setsize(inode_intf self, uint ino, uint newsize) {
+    /* Drop the cached blocks beyond the new size, even if they are dirty. */
+    struct cachedisk_state* cs = self->state;
+    for (uint i = 0; i < cs->nblocks; i++) {
+        struct cache_entry* e = &cs->entries[i];
+        if (e->valid && e->ino == ino && e->offset >= newsize) e->valid = 0;
+    }
+    return cs->below->setsize(cs->below, ino, newsize);
+}
+
+static int cachedisk_read(inode_intf self, uint ino, uint offset,
+                          block_t* block) {
+    struct cachedisk_state* cs = self->state;
+    struct cache_entry* e      = cache_lookup(cs, ino, offset);
+    if (e) {
+        cs->stat.hits++;
+        e->ref = 1;
+        memcpy(block, &cs->blocks[e - cs->entries], BLOCK_SIZE);
+        return 0;
+    }
+
+    cs->stat.misses++;
+    if (cs->direct) return cs->below->read(cs->below, ino, offset, block);
+
+    if ((e = cache_evict(cs)) == NULL) return -1;
+    block_t* cached = &cs->blocks[e - cs->entries];
+    if (cs->below->read(cs->below, ino, offset, cached) < 0) return -1;
+    *e = (struct cache_entry){ino, offset, 1, 0, 1};
+    memcpy(block, cached, BLOCK_SIZE);
+    return 0;
+}
+
+static int cachedisk_read_range(inode_intf self, uint ino, uint offset,
+                                uint nblocks, block_t* blocks) {
+    /* Serve the hits one by one, and read each run of misses with one call
+     * below, directly into blocks[] in the direct mode. A run of misses ends
+     * at any cached block, so a dirty block is always read from the cache
+     * and never from the stale copy below, even in the direct mode. */
+    struct cachedisk_state* cs = self->state;
+    for (uint i = 0, n; i < nblocks; i += n) {
+        for (n = 0; i + n < nblocks; n++)
+            if (cache_lookup(cs, ino, offset + i + n)) break;
+        if (n == 0) {
+            struct cache_entry* e = cache_lookup(cs, ino, offset + i);
+            cs->stat.hits++;
+            e->ref = 1;
+            memcpy(&blocks[i], &cs->blocks[e - cs->entries], BLOCK_SIZE);
+            n = 1;
+            continue;
+        }
+
+        cs->stat.misses += n;
+        if (inode_read_range(cs->below, ino, offset + i, n, &blocks[i]) < 0)
+            return -1;
+        for (uint j = 0; !cs->direct && j < n; j++) {
+            struct cache_entry* e = cache_evict(cs);
+            if (e == NULL) return -1;
+            *e = (struct cache_entry){ino, offset + i + j, 1, 0, 1};
+            memcpy(&cs->blocks[e - cs->entries], &blocks[i + j], BLOCK_SIZE);
+        }
+    }
+    return 0;
+}
+
+static int cachedisk_write(inode_intf self, uint ino, uint offset,
+                           block_t* block) {
+    /* A write covers the whole block, so a miss needs no read from below. */
+    struct cachedisk_state* cs = self->state;
+    struct cache_entry* e      = cache_lookup(cs, ino, offset);
+    if (e) {
+        cs->stat.hits++;
+    } else {
+        cs->stat.misses++;
+        if ((e = cache_evict(cs)) == NULL) return -1;
+        *e = (struct cache_entry){ino, offset, 1, 0, 0};
+    }
+
+    e->dirty = e->ref = 1;
+    memcpy(&cs->blocks[e - cs->entries], block, BLOCK_SIZE);
+    return 0;
+}
+
+static int cachedisk_write_range(inode_intf self, uint ino, uint offset,
+                                 uint nblocks, block_t* blocks) {
+    /* Write the cached blocks into the cache, and each run of uncached
+     * blocks with one call below if it would take over half of the cache or
+     * in the direct mode, or else into the cache as cachedisk_write(). */
+    struct cachedisk_state* cs = self->state;
+    for (uint i = 0, n; i < nblocks; i += n) {
+        for (n = 0; i + n < nblocks; n++)
+            if (cache_lookup(cs, ino, offset + i + n)) break;
+        if (n == 0) {
+            if (cachedisk_write(self, ino, offset + i, &blocks[i]) < 0)
+                return -1;
+            n = 1;
+            continue;
+        }
+
+        if (cs->direct || n >= cs->nblocks / 2) {
+            cs->stat.misses += n;
+            block_t* run = &blocks[i];
+            if (inode_write_range(cs->below, ino, offset + i, n, run) < 0)
+                return -1;
+            continue;
+        }
+        for (uint j = 0; j < n; j++)
+            if (cachedisk_write(self, ino, offset + i + j, &blocks[i + j]) < 0)
+                return -1;
+    }
+    return 0;
+}
+
+int cachedisk_flush(inode_intf self) {
+    /* Write all the dirty blocks to the inode store below, a run at once. */
+    struct cachedisk_state* cs = self->state;
+    int ret                    = 0;
+    for (uint i = 0; i < cs->nblocks; i++) {
+        struct cache_entry* e = &cs->entries[i];
+        if (e->valid && e->dirty && cache_writeback(cs, e) < 0) ret = -1;
+    }
+    return ret;
+}
+
+void cachedisk_direct(inode_intf self, uint direct) {
+    /* While direct is set, a read miss goes to the caller's block directly
+     * without taking a cache entry, so that a long sequential read neither
+     * evicts the other blocks nor adds a copy (e.g., FILE_READ_RANGE). A
+     * hit, including a dirty block not written back yet, is still copied
+     * from the cache. */
+    struct cachedisk_state* cs = self->state;
+    cs->direct                 = direct;
+}
+
+void cachedisk_stat(inode_intf self, struct cache_stat* stat) {
+    struct cachedisk_state* cs = self->state;
+    *stat                      = cs->stat;
+}
+
+inode_intf cachedisk_init(inode_intf below, block_t* blocks, uint nblocks) {
+    /* Create the cache state with all the entries invalid. */
+    struct cachedisk_state* cs = malloc(sizeof(struct cachedisk_state));
+    memset(cs, 0, sizeof(struct cachedisk_state));
+    cs->below   = below;
+    cs->blocks  = blocks;
+    cs->nblocks = nblocks;
+    cs->entries = malloc(nblocks * sizeof(struct cache_entry));
+    cs->run     = malloc(CACHE_RUN_NBLOCKS * sizeof(block_t));
+    memset(cs->entries, 0, nblocks * sizeof(struct cache_entry));
+
+    inode_intf self = malloc(sizeof(struct inode_store));
+    memset(self, 0, sizeof(struct inode_store));
+    self->state       = cs;
+    self->getsize     = cachedisk_getsize;
+    self->setsize     = cachedisk_setsize;
+    self->read        = cachedisk_read;
+    self->write       = cachedisk_write;
+    self->read_range  = cachedisk_read_range;
+    self->write_range = cachedisk_write_range;
+    return self;
+}
@@ -6,6 +6,11 @@ typedef struct block {
     char bytes[BLOCK_SIZE];
 } block_t;
 
+/* The flags of earth->disk_submit() */
+#define DISK_WRITE       1
+#define DISK_PLUG        2   /* hold the request to merge it with later ones */
+#define DISK_MAX_NBLOCKS 256 /* the most blocks of one earth->disk_submit() */
+
 #define SIZE_2MB             (2 * 1024 * 1024)
 #define EGOS_BIN_DISK_SIZE   SIZE_2MB
 #define FILE_SYS_DISK_SIZE   SIZE_2MB
@@ -15,3 +20,7 @@ typedef struct block {
 #define SYS_TERM_EXEC_START  (EGOS_BIN_MAX_NBYTE / BLOCK_SIZE) * 2
 #define SYS_FILE_EXEC_START  (EGOS_BIN_MAX_NBYTE / BLOCK_SIZE) * 3
 #define SYS_SHELL_EXEC_START (EGOS_BIN_MAX_NBYTE / BLOCK_SIZE) * 4
+#define BOHR_BMP_EXEC_START  (EGOS_BIN_MAX_NBYTE / BLOCK_SIZE) * 5
+#define SWAP_DISK_SIZE       SIZE_2MB
+#define SWAP_DISK_START                                                        \
+    (FILE_SYS_DISK_START + FILE_SYS_DISK_SIZE / BLOCK_SIZE)
@@ -83,11 +83,13 @@ inode_intf mydisk_init(inode_intf below, uint below_ino) {
 
     /* Feel free to modify anything below if necessary. */
     inode_intf self = malloc(sizeof(struct inode_store));
-    self->getsize   = mydisk_getsize;
-    self->setsize   = mydisk_setsize;
-    self->read      = mydisk_read;
-    self->write     = mydisk_write;
-    self->state     = below;
+    self->getsize     = mydisk_getsize;
+    self->setsize     = mydisk_setsize;
+    self->read        = mydisk_read;
+    self->write       = mydisk_write;
+    self->read_range  = NULL;
+    self->write_range = NULL;
+    self->state       = below;
     return self;
     /* Student's code ends here. */
 }
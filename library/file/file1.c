@@ -22,6 +22,9 @@
  * below_ino) Opens a virtual inode store within inode below_ino of the inode
  * store below.
  *
+ *        int treedisk_sync(inode_intf self) Writes the free list, which is
+ * kept in memory and written lazily, to the inode store below.
+ *
  * The layout of the file system is described in the file "file1.h".
  */
 
@@ -47,14 +50,57 @@ struct treedisk_snapshot {
     struct treedisk_inode* inode;
 };
 
+/* Copies of the blocks that treedisk reads again and again: the superblock,
+ * the inode blocks, and the last bottom-level indirect block of an inode
+ * (i.e., the last block on its path from the root to the data blocks), which
+ * holds the references to data blocks [first, first + REFS_PER_BLOCK).
+ * Every write of treedisk goes through treedisk_write_below(), which keeps
+ * these copies the same as the blocks below.
+ */
+#define TREEDISK_NINODEBLOCKS 4
+#define TREEDISK_NPATHS       8
+
+struct treedisk_cached_block {
+    uint valid;
+    block_no blockno;
+    union treedisk_block block;
+};
+
+struct treedisk_cached_path {
+    uint valid;
+    uint ino;
+    block_no first;
+    block_no blockno;
+    struct treedisk_indirblock tib;
+};
+
 /* The state of a virtual inode store, which is identified by an inode number.
  */
 struct treedisk_state {
     inode_intf below; /* inode store below */
     uint below_ino;   /* inode number to use for the inode store below */
     uint ninodes;     /* number of inodes in the treedisk */
+
+    struct treedisk_cached_block superblock;
+    struct treedisk_cached_block inodeblocks[TREEDISK_NINODEBLOCKS];
+    struct treedisk_cached_path paths[TREEDISK_NPATHS]; /* indexed by ino */
+    uint inodeblock_next; /* the next entry of inodeblocks to replace */
+
+    block_no* cursors; /* for each inode, the block after its last data
+                          block allocated, or 0 */
+    uint nblocks;      /* number of blocks in the inode store below */
+    uint* free_map;    /* a bit for each block below, set if it is free */
+    uint* list_map;    /* a bit for each block below, set if it holds the
+                          free list on the inode store below */
+    uint nchanges;     /* changes of free_map since the free list was written */
+    block_no run_next; /* blocks [run_next, run_end) are reserved for the */
+    block_no run_end;  /* treedisk_write_range() in progress */
 };
 
+#define BIT_GET(map, i) ((map)[(i) / 32] & (1u << ((i) % 32)))
+#define BIT_SET(map, i) ((map)[(i) / 32] |= (1u << ((i) % 32)))
+#define BIT_CLR(map, i) ((map)[(i) / 32] &= ~(1u << ((i) % 32)))
+
 static uint log_rpb;       /* log2(REFS_PER_BLOCK) */
 static block_t null_block; /* a block filled with null bytes */
 
@@ -77,16 +123,38 @@ static block_no log_shift_r(block_no x, uint nbits) {
     return x >> nbits;
 }
 
+/* Write a block to the inode store below, updating the cached copies of it.
+ */
+static int treedisk_write_below(struct treedisk_state* ts, block_no b,
+                                uint nblocks, block_t* blocks) {
+    for (uint j = 0; j < nblocks; j++) {
+        if (ts->superblock.valid && b + j == 0)
+            memcpy(&ts->superblock.block, &blocks[j], BLOCK_SIZE);
+        for (uint i = 0; i < TREEDISK_NINODEBLOCKS; i++)
+            if (ts->inodeblocks[i].valid && ts->inodeblocks[i].blockno == b + j)
+                memcpy(&ts->inodeblocks[i].block, &blocks[j], BLOCK_SIZE);
+        for (uint i = 0; i < TREEDISK_NPATHS; i++)
+            if (ts->paths[i].valid && ts->paths[i].blockno == b + j)
+                memcpy(&ts->paths[i].tib, &blocks[j], BLOCK_SIZE);
+    }
+
+    return inode_write_range(ts->below, ts->below_ino, b, nblocks, blocks);
+}
+
 /* Get a snapshot of the file system, including the superblock and the block
- * containing the inode, from the inode store below.
+ * containing the inode, from the cached copies or the inode store below.
  */
 static int treedisk_get_snapshot(struct treedisk_snapshot* snapshot,
                                  struct treedisk_state* ts, uint inode_no) {
     /* Get the superblock.
      */
-    if ((*ts->below->read)(ts->below, ts->below_ino, 0,
-                           (block_t*)&snapshot->superblock) < 0)
-        return -1;
+    if (!ts->superblock.valid) {
+        if ((*ts->below->read)(ts->below, ts->below_ino, 0,
+                               (block_t*)&ts->superblock.block) < 0)
+            return -1;
+        ts->superblock.valid = 1;
+    }
+    snapshot->superblock = ts->superblock.block;
 
     /* Check the inode number.
      */
@@ -100,59 +168,201 @@ static int treedisk_get_snapshot(struct treedisk_snapshot* snapshot,
     /* Find the inode.
      */
     snapshot->inode_blockno = 1 + inode_no / INODES_PER_BLOCK;
-    if ((*ts->below->read)(ts->below, ts->below_ino, snapshot->inode_blockno,
-                           (block_t*)&snapshot->inodeblock) < 0)
-        return -1;
+    struct treedisk_cached_block* ib = NULL;
+    for (uint i = 0; i < TREEDISK_NINODEBLOCKS; i++)
+        if (ts->inodeblocks[i].valid &&
+            ts->inodeblocks[i].blockno == snapshot->inode_blockno)
+            ib = &ts->inodeblocks[i];
+
+    if (ib == NULL) {
+        ib                  = &ts->inodeblocks[ts->inodeblock_next];
+        ts->inodeblock_next = (ts->inodeblock_next + 1) % TREEDISK_NINODEBLOCKS;
+        ib->valid           = 0;
+        if ((*ts->below->read)(ts->below, ts->below_ino,
+                               snapshot->inode_blockno,
+                               (block_t*)&ib->block) < 0)
+            return -1;
+        ib->valid   = 1;
+        ib->blockno = snapshot->inode_blockno;
+    }
+    snapshot->inodeblock = ib->block;
 
     snapshot->inode =
         &snapshot->inodeblock.inodeblock.inodes[inode_no % INODES_PER_BLOCK];
     return 0;
 }
 
-/* Allocate a block from the free list.
+/* The free blocks are kept in free_map, which treedisk_init() builds from
+ * the free list. Allocating a block only clears its bit, and the free list is
+ * written again from free_map in a batch, after TREEDISK_LAZY_CHANGES changes
+ * or by treedisk_sync(). Until then, the free list below still holds the
+ * blocks allocated since it was last written. The blocks holding the free
+ * list itself are allocated last, and the free list is written at once when
+ * one of them is allocated, before the block is overwritten.
+ *
+ * So the free list below is up to date only after treedisk_sync(), and
+ * treedisk_init() after a crash may take a block allocated since then as
+ * free. The caller should sync regularly (e.g., sys_file syncs after a
+ * number of writes and whenever an app exits).
  */
-static block_no treedisk_alloc_block(struct treedisk_state* ts,
-                                     struct treedisk_snapshot* snapshot) {
-    block_no b;
+#define TREEDISK_LAZY_CHANGES 128
 
-    if ((b = snapshot->superblock.superblock.free_list) == 0)
-        panic("treedisk_alloc_block: inode store is full\n");
+/* Find the last block before block b whose bit in map is set, or 0 if none
+ * (block 0 is the superblock, so it is never free).
+ */
+static block_no treedisk_prev_bit(uint* map, block_no b) {
+    while (b-- > 0)
+        if (BIT_GET(map, b)) return b;
+    return 0;
+}
+
+/* Write the free list from free_map.  The freelist blocks are the last free
+ * blocks, so that the other free blocks are consecutive when possible.
+ */
+static int treedisk_write_freelist(struct treedisk_state* ts) {
+    uint nfree = 0;
+    for (block_no b = 0; b < ts->nblocks; b++)
+        if (BIT_GET(ts->free_map, b)) nfree++;
 
-    /* Read the freelist block and scan for a free block reference.
+    /* A freelist block holds itself and REFS_PER_BLOCK - 1 free blocks.
      */
-    union treedisk_block freelistblock;
-    if ((*ts->below->read)(ts->below, ts->below_ino, b,
-                           (block_t*)&freelistblock) < 0) {
-        panic("treedisk_alloc_block");
+    block_no ref = ts->nblocks;
+    memset(ts->list_map, 0, (ts->nblocks + 31) / 32 * sizeof(uint));
+    for (uint i = 0; i < (nfree + REFS_PER_BLOCK - 1) / REFS_PER_BLOCK; i++) {
+        ref = treedisk_prev_bit(ts->free_map, ref);
+        BIT_SET(ts->list_map, ref);
     }
-    uint i;
-    for (i = REFS_PER_BLOCK; --i > 0;)
-        if (freelistblock.freelistblock.refs[i] != 0) {
-            break;
-        }
 
-    /* If there is a free block reference use that.  Otherwise use
-     * the free list block itself and update the superblock.
+    /* Fill each freelist block with the next one and the free blocks below
+     * the freelist blocks.
      */
-    block_no free_blockno;
-    if (i == 0) {
-        free_blockno = b;
-        snapshot->superblock.superblock.free_list =
-            freelistblock.freelistblock.refs[0];
-        if ((*ts->below->write)(ts->below, ts->below_ino, 0,
-                                (block_t*)&snapshot->superblock) < 0) {
-            panic("treedisk_alloc_block: superblock");
+    block_no head = treedisk_prev_bit(ts->list_map, ts->nblocks);
+    for (block_no lb = head, next; lb != 0; lb = next) {
+        union treedisk_block listblock;
+        memset(&listblock, 0, BLOCK_SIZE);
+        next                            = treedisk_prev_bit(ts->list_map, lb);
+        listblock.freelistblock.refs[0] = next;
+        for (uint i = 1; i < REFS_PER_BLOCK; i++) {
+            if ((ref = treedisk_prev_bit(ts->free_map, ref)) == 0) break;
+            listblock.freelistblock.refs[i] = ref;
         }
-    } else {
-        free_blockno = freelistblock.freelistblock.refs[i];
-        freelistblock.freelistblock.refs[i] = 0;
-        if ((*ts->below->write)(ts->below, ts->below_ino, b,
-                                (block_t*)&freelistblock) < 0) {
-            panic("treedisk_alloc_block: freelistblock");
+        if (treedisk_write_below(ts, lb, 1, (block_t*)&listblock) < 0)
+            return -1;
+    }
+
+    union treedisk_block superblock = ts->superblock.block;
+    superblock.superblock.free_list = head;
+    ts->nchanges                    = 0;
+    return treedisk_write_below(ts, 0, 1, (block_t*)&superblock);
+}
+
+/* Count the blocks from block b up to n that are free and do not hold the
+ * free list.
+ */
+static uint treedisk_avail(struct treedisk_state* ts, block_no b, uint n) {
+    uint len = 0;
+    for (; b + len < ts->nblocks && len < n; len++)
+        if (!BIT_GET(ts->free_map, b + len) || BIT_GET(ts->list_map, b + len))
+            break;
+    return len;
+}
+
+/* Take n blocks from block b out of free_map.
+ */
+static void treedisk_take(struct treedisk_state* ts, block_no b, uint n) {
+    for (uint i = 0; i < n; i++) BIT_CLR(ts->free_map, b + i);
+    ts->nchanges += n;
+    if (ts->nchanges >= TREEDISK_LAZY_CHANGES &&
+        treedisk_write_freelist(ts) < 0)
+        panic("treedisk_take: free list");
+}
+
+/* Find the first run of n blocks that treedisk_avail() counts, or otherwise
+ * the longest run, and return its length.
+ */
+static uint treedisk_first_fit(struct treedisk_state* ts, uint n,
+                               block_no* first) {
+    uint best_len = 0;
+    for (block_no b = 0, len; b < ts->nblocks && best_len < n; b += len) {
+        /* Skip the blocks that are in use or hold the free list.
+         */
+        uint avail = ts->free_map[b / 32] & ~ts->list_map[b / 32];
+        if (b % 32 == 0 && avail == 0) {
+            len = 32;
+            continue;
+        }
+
+        len = treedisk_avail(ts, b, n);
+        if (len > best_len) {
+            *first   = b;
+            best_len = len;
         }
+        if (len == 0) len = 1;
     }
+    return best_len;
+}
+
+/* Allocate at most n consecutive free blocks, preferring the blocks from
+ * block hint (if not 0) and then the first run of n blocks, and return the
+ * number of blocks allocated starting at *first.
+ */
+static uint treedisk_alloc_run(struct treedisk_state* ts, uint n, block_no hint,
+                               block_no* first) {
+    block_no best = hint;
+    uint best_len = (hint == 0) ? 0 : treedisk_avail(ts, hint, n);
+    if (best_len == 0) best_len = treedisk_first_fit(ts, n, &best);
+
+    if (best_len == 0) {
+        /* Only the freelist blocks are free, so allocate one of them and
+         * write the free list without it right away.
+         */
+        for (block_no b = 0; b < ts->nblocks; b++)
+            if (BIT_GET(ts->free_map, b)) {
+                BIT_CLR(ts->free_map, b);
+                if (treedisk_write_freelist(ts) < 0)
+                    panic("treedisk_alloc_run: free list");
+                *first = b;
+                return 1;
+            }
+        return 0;
+    }
+
+    treedisk_take(ts, best, best_len);
+    *first = best;
+    return best_len;
+}
 
-    return free_blockno;
+/* Allocate a data block of inode ino, which is the next reserved one if any,
+ * or otherwise the block after prev (the data block before it, if not 0) or
+ * after the last data block allocated for the inode, so that the consecutive
+ * blocks of a file are consecutive below.
+ */
+static block_no treedisk_alloc_data(struct treedisk_state* ts, uint ino,
+                                    block_no prev) {
+    block_no b, hint = prev ? prev + 1 : ts->cursors[ino];
+    if (ts->run_next < ts->run_end)
+        b = ts->run_next++;
+    else if (treedisk_alloc_run(ts, 1, hint, &b) == 0)
+        panic("treedisk_alloc_data: inode store is full\n");
+
+    ts->cursors[ino] = b + 1;
+    return b;
+}
+
+/* Allocate an indirect block from the end of the inode store below, away
+ * from the data blocks.
+ */
+static block_no treedisk_alloc_indirect(struct treedisk_state* ts) {
+    for (block_no b = ts->nblocks; b-- > 0;)
+        if (treedisk_avail(ts, b, 1)) {
+            treedisk_take(ts, b, 1);
+            return b;
+        }
+
+    block_no b;
+    if (treedisk_alloc_run(ts, 1, 0, &b) == 0)
+        panic("treedisk_alloc_indirect: inode store is full\n");
+    return b;
 }
 
 /* Retrieve the number of blocks in the file referenced by 'self'.  This
@@ -173,10 +383,60 @@ static int treedisk_setsize(inode_intf self, uint ino, block_no nblocks) {
     return -1;
 }
 
-/* Read a block at the given block number 'offset' and return in *block.
+/* Find the number of the block below that holds block 'offset' of the inode
+ * (0 for a hole), from the last path of the inode if it covers the offset, or
+ * otherwise by walking down from the root block.
  */
-static int treedisk_read(inode_intf self, uint ino, block_no offset,
-                         block_t* block) {
+static int treedisk_map(struct treedisk_state* ts, struct treedisk_inode* inode,
+                        uint ino, block_no offset, block_no* data_no) {
+    /* Figure out how many levels there are in the tree.
+     */
+    uint nlevels = 0;
+    if (inode->nblocks > 0)
+        while (log_shift_r(inode->nblocks - 1, nlevels * log_rpb) != 0) {
+            nlevels++;
+        }
+
+    block_no b                        = inode->root;
+    block_no first                    = offset - offset % REFS_PER_BLOCK;
+    struct treedisk_cached_path* path = &ts->paths[ino % TREEDISK_NPATHS];
+    if (nlevels > 0 && path->valid && path->ino == ino &&
+        path->first == first) {
+        b       = path->tib.refs[offset % REFS_PER_BLOCK];
+        nlevels = 0;
+    }
+
+    union treedisk_block tmp;
+    for (; nlevels > 0 && b != 0; nlevels--) {
+        if ((*ts->below->read)(ts->below, ts->below_ino, b,
+                               (block_t*)&tmp) < 0)
+            return -1;
+
+        /* The block is an indirect block.  Remember it if it is the last
+         * indirect block on the path.
+         */
+        if (nlevels == 1) {
+            path->valid   = 1;
+            path->ino     = ino;
+            path->first   = first;
+            path->blockno = b;
+            path->tib     = tmp.indirblock;
+        }
+
+        /* Figure out the index into this block and get the block number.
+         */
+        uint index = log_shift_r(offset, (nlevels - 1) * log_rpb);
+        b          = tmp.indirblock.refs[index % REFS_PER_BLOCK];
+    }
+
+    *data_no = b;
+    return 0;
+}
+
+/* Read nblocks blocks at the given block number 'offset' into blocks[].
+ */
+static int treedisk_read_range(inode_intf self, uint ino, block_no offset,
+                               uint nblocks, block_t* blocks) {
     struct treedisk_state* ts = self->state;
 
     /* Get info from underlying file system.
@@ -186,55 +446,50 @@ static int treedisk_read(inode_intf self, uint ino, block_no offset,
 
     /* See if the offset is too big.
      */
-    if (offset >= snapshot.inode->nblocks) {
-        printf("!!TDERR: offset too large %u %u\n", offset,
+    if (offset + nblocks > snapshot.inode->nblocks) {
+        printf("!!TDERR: offset too large %u %u\n", offset + nblocks - 1,
                snapshot.inode->nblocks);
         return -1;
     }
 
-    /* Figure out how many levels there are in the tree.
-     */
-    uint nlevels = 0;
-    if (snapshot.inode->nblocks > 0)
-        while (log_shift_r(snapshot.inode->nblocks - 1, nlevels * log_rpb) !=
-               0) {
-            nlevels++;
-        }
-
-    /* Walk down from the root block.
+    /* Read each run of consecutive blocks below with one call, and return
+     * the null block for a hole.
      */
-    block_no b = snapshot.inode->root;
-    for (;;) {
-        /* If there's a hole, return the null block.
-         */
+    for (uint i = 0, n; i < nblocks; i += n) {
+        block_no b, next;
+        if (treedisk_map(ts, snapshot.inode, ino, offset + i, &b) < 0)
+            return -1;
         if (b == 0) {
-            memset(block, 0, BLOCK_SIZE);
-            return 0;
+            memset(&blocks[i], 0, BLOCK_SIZE);
+            n = 1;
+            continue;
         }
 
-        /* Return the next level.  If the last level, we're done.
-         */
-        int result = (*ts->below->read)(ts->below, ts->below_ino, b, block);
-        if (result < 0) return result;
-        if (nlevels == 0) return 0;
-
-        /* The block is an indirect block.  Figure out the index into this
-         * block and get the block number.
-         */
-        nlevels--;
-        struct treedisk_indirblock* tib = (struct treedisk_indirblock*)block;
-        uint index = log_shift_r(offset, nlevels * log_rpb) % REFS_PER_BLOCK;
-        b          = tib->refs[index];
+        for (n = 1; i + n < nblocks; n++) {
+            if (treedisk_map(ts, snapshot.inode, ino, offset + i + n,
+                             &next) < 0)
+                return -1;
+            if (next != b + n) break;
+        }
+        if (inode_read_range(ts->below, ts->below_ino, b, n, &blocks[i]) < 0)
+            return -1;
     }
     return 0;
 }
 
-/* Write *block at the given block number 'offset'.
+/* Read a block at the given block number 'offset' and return in *block.
  */
-static int treedisk_write(inode_intf self, uint ino, block_no offset,
-                          block_t* block) {
-    struct treedisk_state* ts = self->state;
-    uint dirty_inode          = 0;
+static int treedisk_read(inode_intf self, uint ino, block_no offset,
+                         block_t* block) {
+    return treedisk_read_range(self, ino, offset, 1, block);
+}
+
+/* Find the number of the block below for block 'offset' of the inode like
+ * treedisk_map(), but allocate the block (and indirect blocks) if necessary.
+ */
+static int treedisk_write_map(struct treedisk_state* ts, uint ino,
+                              block_no offset, block_no* data_no) {
+    uint dirty_inode = 0;
 
     /* Get info from underlying file system.
      */
@@ -272,7 +527,7 @@ static int treedisk_write(inode_intf self, uint ino, block_no offset,
         nlevels = nlevels_after;
     } else if (nlevels_after > nlevels) {
         while (nlevels_after > nlevels) {
-            block_no indir = treedisk_alloc_block(ts, snapshot);
+            block_no indir = treedisk_alloc_indirect(ts);
 
             /* Insert the new indirect block into the inode.
              */
@@ -281,8 +536,7 @@ static int treedisk_write(inode_intf self, uint ino, block_no offset,
             tib.refs[0]           = snapshot->inode->root;
             snapshot->inode->root = indir;
             dirty_inode           = 1;
-            if ((*ts->below->write)(ts->below, ts->below_ino, indir,
-                                    (block_t*)&tib) < 0) {
+            if (treedisk_write_below(ts, indir, 1, (block_t*)&tib) < 0) {
                 panic("treedisk_write: indirect block");
             }
 
@@ -293,16 +547,15 @@ static int treedisk_write(inode_intf self, uint ino, block_no offset,
     /* If the inode block was updated, write it back now.
      */
     if (dirty_inode)
-        if ((*ts->below->write)(ts->below, ts->below_ino,
-                                snapshot->inode_blockno,
-                                (block_t*)&snapshot->inodeblock) < 0) {
+        if (treedisk_write_below(ts, snapshot->inode_blockno, 1,
+                                 (block_t*)&snapshot->inodeblock) < 0) {
             panic("treedisk_write: inode block");
         }
 
     /* Find the block by walking the tree, allocating new blocks
      * (and indirect blocks) if necessary.
      */
-    block_no b;
+    block_no b, prev      = 0; /* the data block before the one at offset */
     block_no* parent_no   = &snapshot->inode->root;
     block_no parent_off   = snapshot->inode_blockno;
     block_t* parent_block = (block_t*)&snapshot->inodeblock;
@@ -311,9 +564,10 @@ static int treedisk_write(inode_intf self, uint ino, block_no offset,
          */
         struct treedisk_indirblock tib;
         if ((b = *parent_no) == 0) {
-            b = *parent_no = treedisk_alloc_block(ts, snapshot);
-            if ((*ts->below->write)(ts->below, ts->below_ino, parent_off,
-                                    parent_block) < 0)
+            b = *parent_no = (nlevels == 0)
+                                 ? treedisk_alloc_data(ts, ino, prev)
+                                 : treedisk_alloc_indirect(ts);
+            if (treedisk_write_below(ts, parent_off, 1, parent_block) < 0)
                 panic("treedisk_write: parent");
             if (nlevels == 0) break;
             memset(&tib, 0, BLOCK_SIZE);
@@ -331,13 +585,67 @@ static int treedisk_write(inode_intf self, uint ino, block_no offset,
         parent_no    = &tib.refs[index];
         parent_block = (block_t*)&tib;
         parent_off   = b;
+        prev         = (nlevels == 0 && index > 0) ? tib.refs[index - 1] : 0;
+    }
+
+    *data_no = b;
+    return 0;
+}
+
+/* Write nblocks blocks in blocks[] at the given block number 'offset'.
+ */
+static int treedisk_write_range(inode_intf self, uint ino, block_no offset,
+                                uint nblocks, block_t* blocks) {
+    struct treedisk_state* ts = self->state;
+    struct treedisk_snapshot snapshot;
+    if (treedisk_get_snapshot(&snapshot, ts, ino) < 0) return -1;
+
+    /* Reserve a run for the data blocks appended by this write, so that they
+     * are consecutive below (indirect blocks are allocated elsewhere).
+     */
+    uint size = snapshot.inode->nblocks;
+    if (offset + nblocks > size) {
+        uint grow   = offset + nblocks - (offset > size ? offset : size);
+        uint len    = treedisk_alloc_run(ts, grow, ts->cursors[ino],
+                                         &ts->run_next);
+        ts->run_end = ts->run_next + len;
+    }
+
+    /* Write each run of consecutive blocks below with one call.
+     */
+    for (uint i = 0, n; i < nblocks; i += n) {
+        block_no b, next;
+        if (treedisk_write_map(ts, ino, offset + i, &b) < 0) return -1;
+        for (n = 1; i + n < nblocks; n++) {
+            if (treedisk_write_map(ts, ino, offset + i + n, &next) < 0)
+                return -1;
+            if (next != b + n) break;
+        }
+        if (treedisk_write_below(ts, b, n, &blocks[i]) < 0)
+            panic("treedisk_write: data block");
     }
 
-    if ((*ts->below->write)(ts->below, ts->below_ino, b, block) < 0)
-        panic("treedisk_write: data block");
+    /* Free the reserved blocks that are not used.
+     */
+    for (; ts->run_next < ts->run_end; ts->run_next++, ts->nchanges++)
+        BIT_SET(ts->free_map, ts->run_next);
     return 0;
 }
 
+/* Write *block at the given block number 'offset'.
+ */
+static int treedisk_write(inode_intf self, uint ino, block_no offset,
+                          block_t* block) {
+    return treedisk_write_range(self, ino, offset, 1, block);
+}
+
+/* Write the free list if free_map has changed since it was last written.
+ */
+int treedisk_sync(inode_intf self) {
+    struct treedisk_state* ts = self->state;
+    return ts->nchanges ? treedisk_write_freelist(ts) : 0;
+}
+
 /* Open a virtual inode store on the specified inode of the inode store below.
  */
 
@@ -357,15 +665,47 @@ inode_intf treedisk_init(inode_intf below, uint below_ino) {
     ts->below     = below;
     ts->below_ino = below_ino;
 
+    /* Build free_map from the free list below.
+     */
+    ts->nblocks  = (*below->getsize)(below, below_ino);
+    uint nwords  = (ts->nblocks + 31) / 32;
+    ts->free_map = malloc(nwords * sizeof(uint));
+    ts->list_map = malloc(nwords * sizeof(uint));
+    memset(ts->free_map, 0, nwords * sizeof(uint));
+    memset(ts->list_map, 0, nwords * sizeof(uint));
+
+    union treedisk_block* superblock = &ts->superblock.block;
+    if ((*below->read)(below, below_ino, 0, (block_t*)superblock) < 0)
+        panic("treedisk_init: superblock");
+    ts->superblock.valid = 1;
+
+    uint ninodes = superblock->superblock.n_inodeblocks * INODES_PER_BLOCK;
+    ts->cursors  = malloc(ninodes * sizeof(block_no));
+    memset(ts->cursors, 0, ninodes * sizeof(block_no));
+
+    union treedisk_block listblock;
+    block_no b = superblock->superblock.free_list;
+    for (; b != 0; b = listblock.freelistblock.refs[0]) {
+        if ((*below->read)(below, below_ino, b, (block_t*)&listblock) < 0)
+            panic("treedisk_init: free list");
+        BIT_SET(ts->free_map, b);
+        BIT_SET(ts->list_map, b);
+        for (uint i = 1; i < REFS_PER_BLOCK; i++)
+            if (listblock.freelistblock.refs[i] != 0)
+                BIT_SET(ts->free_map, listblock.freelistblock.refs[i]);
+    }
+
     /* Return a block interface to this inode.
      */
     inode_intf self = malloc(sizeof(struct inode_store));
     memset(self, 0, sizeof(struct inode_store));
-    self->state   = ts;
-    self->getsize = treedisk_getsize;
-    self->setsize = treedisk_setsize;
-    self->read    = treedisk_read;
-    self->write   = treedisk_write;
+    self->state       = ts;
+    self->getsize     = treedisk_getsize;
+    self->setsize     = treedisk_setsize;
+    self->read        = treedisk_read;
+    self->write       = treedisk_write;
+    self->read_range  = treedisk_read_range;
+    self->write_range = treedisk_write_range;
     return self;
 }
 
@@ -0,0 +1,36 @@
+/*
+ * (C) 2025, Cornell University
+ * All rights reserved.
+ *
+ * Description: the default range read and write of inode stores
+ * An inode store without read_range or write_range (see inode.h) transfers
+ * the blocks of a range one by one with its read or write.
+ */
+
+#ifdef MKFS
+#include <sys/types.h>
+#else
+#include "egos.h"
+#endif
+
+#include "inode.h"
+
+int inode_read_range(inode_intf self, uint ino, uint offset, uint nblocks,
+                     block_t* blocks) {
+    if (self->read_range)
+        return self->read_range(self, ino, offset, nblocks, blocks);
+
+    for (uint i = 0; i < nblocks; i++)
+        if (self->read(self, ino, offset + i, &blocks[i]) < 0) return -1;
+    return 0;
+}
+
+int inode_write_range(inode_intf self, uint ino, uint offset, uint nblocks,
+                      block_t* blocks) {
+    if (self->write_range)
+        return self->write_range(self, ino, offset, nblocks, blocks);
+
+    for (uint i = 0; i < nblocks; i++)
+        if (self->write(self, ino, offset + i, &blocks[i]) < 0) return -1;
+    return 0;
+}
@@ -26,6 +26,12 @@
  * int write(inode_intf self, unsigned int ino, uint offset, block_t *block)
  *   - writes *block to the block at the given inode number and offset
  *
+ * An inode store may also provide read_range and write_range, which read or
+ * write nblocks consecutive blocks starting at offset with one call, so that
+ * the disk can transfer them with one command.  They may be NULL, and the
+ * callers use inode_read_range() and inode_write_range() in inode.c, which
+ * fall back to reading or writing one block at a time.
+ *
  * All these return -1 upon error (typically after printing the eason for
  * the error) and return 0 upon success.
  *
@@ -44,12 +50,31 @@ struct inode_store {
     int (*setsize)(inode_intf self, uint ino, uint newsize);
     int (*read)(inode_intf self, uint ino, uint offset, block_t* block);
     int (*write)(inode_intf self, uint ino, uint offset, block_t* block);
+    int (*read_range)(inode_intf self, uint ino, uint offset, uint nblocks,
+                      block_t* blocks);
+    int (*write_range)(inode_intf self, uint ino, uint offset, uint nblocks,
+                       block_t* blocks);
     void* state;
 };
 
+int inode_read_range(inode_intf self, uint ino, uint offset, uint nblocks,
+                     block_t* blocks);
+int inode_write_range(inode_intf self, uint ino, uint offset, uint nblocks,
+                      block_t* blocks);
+
 /* There are 2 file systems in egos-2000 right now: mydisk and treedisk. */
 inode_intf mydisk_init(inode_intf below, uint below_ino);
 int mydisk_create(inode_intf below, uint below_ino, uint ninodes);
 
 inode_intf treedisk_init(inode_intf below, uint below_ino);
 int treedisk_create(inode_intf below, uint below_ino, uint ninodes);
+int treedisk_sync(inode_intf self);
+
+/* A write-back block cache that can be stacked on any inode store. */
+struct cache_stat {
+    uint hits, misses, writebacks;
+};
+inode_intf cachedisk_init(inode_intf below, block_t* blocks, uint nblocks);
+int cachedisk_flush(inode_intf self);
+void cachedisk_direct(inode_intf self, uint direct);
+void cachedisk_stat(inode_intf self, struct cache_stat* stat);
@@ -20,6 +20,27 @@ void exit(int status) {
     while (1);
 }
 
+int fork() {
+    struct proc_request req;
+    struct proc_reply reply;
+    req.type = PROC_FORK;
+    sys_send(GPID_PROCESS, (void*)&req, sizeof(req));
+    sys_recv(GPID_PROCESS, NULL, (void*)&reply, sizeof(reply));
+    return reply.type == CMD_OK ? reply.pid : -1;
+}
+
+uint proc_memstat(struct mmu_stat* stats, uint n) {
+    struct proc_request req;
+    req.type = PROC_MEMSTAT;
+    sys_send(GPID_PROCESS, (void*)&req, sizeof(req));
+    sys_recv(GPID_PROCESS, &sender, buf, SYSCALL_MSG_LEN);
+
+    struct proc_reply* reply = (void*)buf;
+    uint cnt = reply->nstats < n ? reply->nstats : n;
+    memcpy(stats, reply->stats, cnt * sizeof(struct mmu_stat));
+    return cnt;
+}
+
 void sleep(uint usec) {
     /* Student's code goes here (System Call & Protection). */
 
@@ -58,6 +79,77 @@ int file_read(int file_ino, uint offset, char* block) {
     return reply->status == FILE_OK ? 0 : -1;
 }
 
+int file_write(int file_ino, uint offset, char* block) {
+    struct file_request req;
+    req.type   = FILE_WRITE;
+    req.ino    = file_ino;
+    req.offset = offset;
+    memcpy(req.block.bytes, block, BLOCK_SIZE);
+
+    sys_send(GPID_FILE, (void*)&req, sizeof(req));
+    sys_recv(GPID_FILE, &sender, buf, SYSCALL_MSG_LEN);
+
+    struct file_reply* reply = (void*)buf;
+    return reply->status == FILE_OK ? 0 : -1;
+}
+
+int file_read_range(int file_ino, uint offset, uint nblocks, char* dst) {
+    /* GPID_FILE writes the blocks to dst directly, so dst should be a page
+     * given by earth->mmu_alloc and the caller should be a system process. */
+    struct file_request req;
+    req.type    = FILE_READ_RANGE;
+    req.ino     = file_ino;
+    req.offset  = offset;
+    req.nblocks = nblocks;
+    req.dst     = dst;
+
+    sys_send(GPID_FILE, (void*)&req, sizeof(req));
+    sys_recv(GPID_FILE, &sender, buf, SYSCALL_MSG_LEN);
+
+    struct file_reply* reply = (void*)buf;
+    return reply->status == FILE_OK ? 0 : -1;
+}
+
+int file_stat(int file_ino, uint* gen) {
+    struct file_request req;
+    req.type = FILE_STAT;
+    req.ino  = file_ino;
+
+    sys_send(GPID_FILE, (void*)&req, sizeof(req));
+    sys_recv(GPID_FILE, &sender, buf, SYSCALL_MSG_LEN);
+
+    struct file_reply* reply = (void*)buf;
+    *gen                     = reply->gen;
+    return reply->status == FILE_OK ? 0 : -1;
+}
+
+int file_sync(uint* hits, uint* misses) {
+    /* GPID_FILE writes its dirty blocks to the disk before replying, and for
+     * a user app, the dirty blocks of the RAM disk as well. */
+    struct file_request req;
+    req.type = FILE_SYNC;
+
+    sys_send(GPID_FILE, (void*)&req, sizeof(req));
+    sys_recv(GPID_FILE, &sender, buf, SYSCALL_MSG_LEN);
+
+    struct file_reply* reply = (void*)buf;
+    *hits                    = reply->hits;
+    *misses                  = reply->misses;
+    return reply->status == FILE_OK ? 0 : -1;
+}
+
+int file_iostat(struct disk_stat* stat) {
+    struct file_request req;
+    req.type = FILE_IOSTAT;
+
+    sys_send(GPID_FILE, (void*)&req, sizeof(req));
+    sys_recv(GPID_FILE, &sender, buf, SYSCALL_MSG_LEN);
+
+    struct file_reply* reply = (void*)buf;
+    memcpy(stat, &reply->stat, sizeof(struct disk_stat));
+    return reply->status == FILE_OK ? 0 : -1;
+}
+
 #ifndef KERNEL
 
 /* Terminal read/write for user applications send messages to GPID_TERMINAL. */
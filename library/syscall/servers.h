@@ -1,11 +1,18 @@
 #pragma once
 
 void exit(int status);
+int fork();
+uint proc_memstat(struct mmu_stat* stats, uint n);
 void sleep(uint usec);
 int term_read(char* buf, uint len);
 void term_write(char* str, uint len);
 int dir_lookup(int dir_ino, char* name);
 int file_read(int file_ino, uint offset, char* block);
+int file_write(int file_ino, uint offset, char* block);
+int file_read_range(int file_ino, uint offset, uint nblocks, char* dst);
+int file_stat(int file_ino, uint* gen);
+int file_sync(uint* hits, uint* misses);
+int file_iostat(struct disk_stat* stat);
 
 enum grass_servers {
     GPID_ALL = -1,
@@ -17,6 +24,21 @@ enum grass_servers {
     GPID_USER_START /* 5 */
 };
 
+/* Pages cached by GPID_PROCESS are owned by pids GPID_EXEC_CACHE - i where
+ * i < EXEC_CACHE_CNT is the index of the cache entry, and the pages of the
+ * shared C library are owned by pid GPID_LIB (see apps/system/sys_proc.c).
+ * earth->mmu_alloc may free the cached pages when running out of memory. */
+#define GPID_EXEC_CACHE -64
+#define EXEC_CACHE_CNT  8
+#define GPID_LIB        -32
+/* The staging page of a compressed segment is owned by GPID_ELF_STAGE during
+ * one call of elf_load_segments (see library/elf/elf.c). */
+#define GPID_ELF_STAGE -16
+
+/* GPID_FILE receives a message from GPID_DISK when its disk request submitted
+ * by earth->disk_submit completes (see earth/dev_disk.c). */
+#define GPID_DISK -2
+
 /* GPID_PROCESS */
 #define CMD_NARGS   16
 #define CMD_ARG_LEN 32
@@ -25,14 +47,19 @@ struct proc_request {
     /* Student's code goes here (System Call & Protection). */
 
     /* Update struct proc_request to support process sleep. */
-    enum { PROC_SPAWN, PROC_EXIT, PROC_KILLALL } type;
+    enum { PROC_SPAWN, PROC_EXIT, PROC_KILLALL, PROC_FORK, PROC_MEMSTAT } type;
     int argc;
     char argv[CMD_NARGS][CMD_ARG_LEN];
     /* Student's code ends here. */
 };
 
+#define PROC_MEMSTAT_CNT 32
 struct proc_reply {
     enum { CMD_OK, CMD_ERROR } type;
+    int pid; /* for PROC_FORK: 0 in the child and the child pid in parent */
+    /* for PROC_MEMSTAT: the first nstats entries given by earth->mmu_stat */
+    uint nstats;
+    struct mmu_stat stats[PROC_MEMSTAT_CNT];
 };
 
 /* GPID_TERMINAL */
@@ -55,13 +82,23 @@ struct file_request {
         FILE_UNUSED,
         FILE_READ,
         FILE_WRITE,
+        FILE_READ_RANGE, /* from system processes only */
+        FILE_STAT,
+        FILE_SYNC,
+        FILE_IOSTAT,
     } type;
     uint ino;
     uint offset;
     block_t block;
+    uint nblocks; /* for FILE_READ_RANGE: read nblocks blocks to dst */
+    char* dst;
 };
 
 struct file_reply {
     enum file_status { FILE_OK, FILE_ERROR } status;
     block_t block;
+    uint gen; /* for FILE_STAT: changes whenever the inode is written */
+    /* for FILE_SYNC: the hit and miss counters of the block cache */
+    uint hits, misses;
+    struct disk_stat stat; /* for FILE_IOSTAT: given by earth->disk_stat */
 };
@@ -12,16 +12,48 @@
 static struct syscall* sc = (struct syscall*)SYSCALL_ARG;
 
 void sys_send(int receiver, char* msg, uint size) {
-    sc->type     = SYS_SEND;
-    sc->receiver = receiver;
+    sc->type         = SYS_SEND;
+    sc->receiver     = receiver;
+    sc->grant_npages = 0;
     memcpy(sc->content, msg, size);
     asm("ecall");
 }
 
 void sys_recv(int from, int* sender, char* buf, uint size) {
-    sc->type   = SYS_RECV;
-    sc->sender = from;
+    sc->type         = SYS_RECV;
+    sc->sender       = from;
+    sc->grant_npages = 0;
     asm("ecall");
     memcpy(buf, sc->content, size);
     if (sender) *sender = sc->sender;
 }
+
+/* Besides msg, sys_send_pages() moves npages pages starting at pages to the
+ * receiver without copying them, and the sender gets zeroed pages in return.
+ * The receiver should call sys_recv_pages() with a window of at least npages
+ * pages, and *npages is set to the number of pages actually granted. Both
+ * return -1 if the kernel rejects the grant (see GRANT_ERROR in syscall.h),
+ * in which case msg is still delivered but no page is moved. */
+int sys_send_pages(int receiver, char* msg, uint size, void* pages,
+                   uint npages) {
+    sc->type         = SYS_SEND;
+    sc->receiver     = receiver;
+    sc->grant_vaddr  = (uint)pages;
+    sc->grant_npages = npages;
+    memcpy(sc->content, msg, size);
+    asm("ecall");
+    return sc->grant_npages == GRANT_ERROR ? -1 : sc->grant_npages;
+}
+
+int sys_recv_pages(int from, int* sender, char* buf, uint size, void* pages,
+                   uint* npages) {
+    sc->type         = SYS_RECV;
+    sc->sender       = from;
+    sc->grant_vaddr  = (uint)pages;
+    sc->grant_npages = *npages;
+    asm("ecall");
+    memcpy(buf, sc->content, size);
+    if (sender) *sender = sc->sender;
+    *npages = (sc->grant_npages == GRANT_ERROR) ? 0 : sc->grant_npages;
+    return sc->grant_npages == GRANT_ERROR ? -1 : 0;
+}
@@ -9,13 +9,26 @@ enum syscall_type {
 };
 
 #define SYSCALL_MSG_LEN 1024
+/* The pages granted by one message must lie in the private code, data and
+ * heap of an app, i.e., [APPS_ENTRY, APPS_ARG), and the receiver must take
+ * all of them. Otherwise, the message is delivered without moving any page
+ * and grant_npages is set to GRANT_ERROR for both the sender and receiver. */
+#define GRANT_PAGE_SIZE  4096
+#define GRANT_MAX_NPAGES 64
+#define GRANT_ERROR      ((uint)-1)
 struct syscall {
     enum syscall_type type; /* SYS_SEND or SYS_RECV */
     int sender;             /* sender process ID    */
     int receiver;           /* receiver process ID  */
     char content[SYSCALL_MSG_LEN];
     enum { PENDING, DONE } status;
+    uint grant_vaddr;  /* page-aligned address of the granted pages  */
+    uint grant_npages; /* # pages granted by sender or taken by recv */
 };
 
 void sys_send(int receiver, char* msg, uint size);
 void sys_recv(int from, int* sender, char* buf, uint size);
+int sys_send_pages(int receiver, char* msg, uint size, void* pages,
+                   uint npages);
+int sys_recv_pages(int from, int* sender, char* buf, uint size, void* pages,
+                   uint* npages);
@@ -3,15 +3,19 @@
  * All rights reserved.
  *
  * Description: generate disk image (disk.img) and ROM image (fpgaROM.bin)
- * The disk image should be exactly 4MB:
+ * The disk image should be exactly 6MB:
  *     2MB holds the executables of EGOS and system servers;
- *     2MB is managed by a file system.
+ *     2MB is managed by a file system;
+ *     2MB is reserved as the swap area of earth/cpu_mmu.c.
  * This disk image should be programmed to the microSD card.
  *
  * The ROM image should be exactly 8MB:
  *     4MB holds the VexRiscv processor FPGA binary;
- *     4MB holds the disk image described above.
+ *     4MB holds the first 4MB of the disk image described above.
  * This ROM image should be programmed to the ROM chip on the FPGA board.
+ *
+ * With COMPRESS=1, the segments of the system servers and user apps are
+ * compressed page by page in the LZ4 block format (see elf_compress).
  */
 
 #include <stdio.h>
@@ -25,6 +29,13 @@
 #include <sys/types.h>
 #include "inode.h"
 
+typedef unsigned char uchar;
+#include "elf.h"
+
+#ifndef COMPRESS
+#define COMPRESS 0
+#endif
+
 char* egos_binaries[] = {"./egos.bin",
                          "../build/release/sys_proc.elf",
                          "../build/release/sys_terminal.elf",
@@ -35,7 +46,7 @@ char* egos_binaries[] = {"./egos.bin",
 
 char bin_dir[256] = "./   6 ../   0 ";
 char* contents[]  = {
-    "./   0 ../   0 home/   1 bin/   6 ",
+    "./   0 ../   0 home/   1 bin/   6 lib/   7 ",
     "./   1 ../   0 yunhao/   2 rvr/   3 yacqub/   4 ",
     "./   2 ../   1 README   5 ",
     "./   3 ../   1 ",
@@ -45,11 +56,15 @@ char* contents[]  = {
      "exception handling, preemptive scheduler, system call, file system, "
      "shell, an Ethernet/UDP demo, several user commands, and the mkfs tool. "
      "Moreover, the EGOS book (https://egos.fun) contains 9 course projects.",
-    bin_dir};
-#define BIN_DIR_INODE ((sizeof(contents) / sizeof(char*)) - 1)
+    bin_dir,
+    "./   7 ../   0 libegos   8 "};
+#define CONTENTS_NUM  ((sizeof(contents) / sizeof(char*)))
+#define BIN_DIR_INODE 6
+#define LIB_INODE     8 /* the shared C library, see library/elf/lib.lds */
 
 char inode[SIZE_2MB], tmp[512];
 char vexriscv[SIZE_2MB * 2], exec[SIZE_2MB], fs[SIZE_2MB];
+char swap[SWAP_DISK_SIZE]; /* the swap area starts with all zeros */
 
 int load_file(char* file_name, char* dst) {
     struct stat st;
@@ -62,6 +77,111 @@ int load_file(char* file_name, char* dst) {
     return st.st_size;
 }
 
+#define PAGE_SIZE  4096
+#define NBLOCKS(x) (((x) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+
+static uchar* lz4_length(uchar* dst, int n) {
+    /* A length of 15 or more continues with bytes until one is below 255. */
+    for (n -= 15; n >= 255; n -= 255) *dst++ = 255;
+    *dst++ = n;
+    return dst;
+}
+
+static uchar* lz4_emit(uchar* dst, uchar* lit, int nlit, int offset, int n) {
+    /* Emit nlit literals followed by a match of n bytes (n=0 for no match). */
+    uchar* token = dst++;
+    *token       = (nlit < 15 ? nlit : 15) << 4;
+    if (nlit >= 15) dst = lz4_length(dst, nlit);
+    memcpy(dst, lit, nlit);
+    dst += nlit;
+    if (n == 0) return dst;
+
+    *dst++ = offset & 0xFF;
+    *dst++ = offset >> 8;
+    *token |= (n - 4 < 15) ? n - 4 : 15;
+    return (n - 4 >= 15) ? lz4_length(dst, n - 4) : dst;
+}
+
+static int lz4_encode(uchar* src, int len, uchar* dst) {
+    /* A greedy LZ4 encoder finding matches with a hash of 4-byte strings. */
+    int table[4096], anchor = 0;
+    uchar* start = dst;
+    memset(table, 0xFF, sizeof(table));
+
+    /* As LZ4 requires, the last 5 bytes are always literals. */
+    for (int i = 0; i + 12 <= len;) {
+        uint seq, ref_seq, h;
+        memcpy(&seq, src + i, 4);
+        h        = (seq * 2654435761U) >> 20;
+        int ref  = table[h];
+        table[h] = i;
+        if (ref >= 0) memcpy(&ref_seq, src + ref, 4);
+        if (ref < 0 || ref_seq != seq) {
+            i++;
+            continue;
+        }
+
+        int n = 4;
+        while (i + n < len - 5 && src[ref + n] == src[i + n]) n++;
+        dst = lz4_emit(dst, src + anchor, i - anchor, i - ref, n);
+        i = anchor = i + n;
+    }
+    dst = lz4_emit(dst, src + anchor, len - anchor, 0, 0);
+    return dst - start;
+}
+
+int elf_compress(char* elf, int size) {
+    /* Keep the first block holding the ELF header and program headers, and
+     * compress the loadable segments as elf_load_segments() expects. */
+    static char out[SIZE_2MB];
+    memcpy(out, elf, BLOCK_SIZE);
+    struct elf32_header* header          = (void*)out;
+    struct elf32_program_header* pheader = (void*)(out + header->e_phoff);
+    assert(header->e_phoff + header->e_phnum * sizeof(*pheader) <= BLOCK_SIZE);
+    header->e_shoff = header->e_shnum = header->e_shstrndx = 0;
+
+    uint nbytes = BLOCK_SIZE;
+    for (uint i = 0; i < header->e_phnum; i++) {
+        struct elf32_program_header* seg = &pheader[i];
+        if (seg->p_type != PT_LOAD) seg->p_offset = seg->p_filesz = 0;
+        if (seg->p_filesz == 0) continue;
+
+        /* The first block holds the compressed size of every page. */
+        uint npages  = (seg->p_filesz + PAGE_SIZE - 1) / PAGE_SIZE;
+        ushort* clen = (void*)(out + nbytes);
+        assert(seg->p_vaddr % PAGE_SIZE == 0);
+        assert(npages <= BLOCK_SIZE / sizeof(ushort));
+        memset(clen, 0, BLOCK_SIZE);
+        char* src_base = elf + seg->p_offset;
+        seg->p_offset  = nbytes;
+        seg->p_flags |= PF_EGOS_LZ4;
+        nbytes += BLOCK_SIZE;
+
+        for (uint k = 0; k < npages; k++) {
+            uchar* src = (void*)(src_base + k * PAGE_SIZE);
+            uchar* dst = (void*)(out + nbytes);
+            int len    = seg->p_filesz - k * PAGE_SIZE;
+            len        = (len < PAGE_SIZE) ? len : PAGE_SIZE;
+
+            /* Store the page as it is if compression saves no block. */
+            int n = lz4_encode(src, len, dst);
+            if (NBLOCKS(n) < NBLOCKS(len)) {
+                clen[k] = n;
+            } else {
+                memcpy(dst, src, n = len);
+            }
+            memset(dst + n, 0, NBLOCKS(n) * BLOCK_SIZE - n);
+            nbytes += NBLOCKS(n) * BLOCK_SIZE;
+        }
+    }
+
+    /* Replace the ELF file with the compressed one. */
+    assert(nbytes <= SIZE_2MB);
+    memset(elf, 0, size);
+    memcpy(elf, out, nbytes);
+    return nbytes;
+}
+
 int getsize(inode_intf bs, uint ino) { return FILE_SYS_DISK_SIZE / BLOCK_SIZE; }
 
 int setsize(inode_intf bs, uint ino, uint newsize) { assert(0); }
@@ -76,11 +196,25 @@ int ramwrite(inode_intf bs, uint ino, uint offset, block_t* block) {
     return 0;
 }
 
+int load_elf(inode_intf filesys, uint ino, char* file_name) {
+    int file_size = load_file(file_name, inode);
+    if (COMPRESS) file_size = elf_compress(inode, file_size);
+    printf("[INFO] Load ino=%d, %s: %d bytes\n", ino, file_name, file_size);
+
+    /* Write the ELF format binary into inode ino with one range write, so
+     * that treedisk lays out its blocks consecutively. */
+    inode_write_range(filesys, ino, 0, NBLOCKS(file_size), (void*)inode);
+    return file_size;
+}
+
 int main() {
     /* Write the kernel and system server binaries into exec[]. */
     printf("[INFO] Load %ld kernel binary files\n", EGOS_BIN_NUM);
     for (uint i = 0; i < EGOS_BIN_NUM; i++) {
-        int sz = load_file(egos_binaries[i], exec + i * EGOS_BIN_MAX_NBYTE);
+        char* bin = exec + i * EGOS_BIN_MAX_NBYTE;
+        int sz    = load_file(egos_binaries[i], bin);
+        if (COMPRESS && strstr(egos_binaries[i], ".elf"))
+            assert((sz = elf_compress(bin, sz)) <= EGOS_BIN_MAX_NBYTE);
         printf("[INFO] Load %s: %d bytes\n", egos_binaries[i], sz);
     }
 
@@ -95,28 +229,25 @@ int main() {
     inode_intf filesys =
         (FILESYS == 0) ? mydisk_init(&ramdisk, 0) : treedisk_init(&ramdisk, 0);
 
-    /* Write to inode 0..BIN_DIR_INODE-1 in the file system. */
-    for (uint ino = 0; ino < BIN_DIR_INODE; ino++) {
+    /* Write the directories and README except /bin into the file system. */
+    for (uint ino = 0; ino < CONTENTS_NUM; ino++) {
+        if (ino == BIN_DIR_INODE) continue;
         printf("[INFO] Load ino=%d, %ld bytes\n", ino, strlen(contents[ino]));
         strncpy(inode, contents[ino], BLOCK_SIZE);
         filesys->write(filesys, ino, 0, (void*)inode);
     }
 
+    /* Write the shared C library linked by every user application. */
+    load_elf(filesys, LIB_INODE, "../build/release/libegos.elf");
+
     /* Write to one inode for each user application. */
-    uint app_ino = BIN_DIR_INODE + 1;
+    uint app_ino = LIB_INODE + 1;
     DIR* dp      = opendir("../build/release/user");
     assert(dp != NULL);
     for (struct dirent* ep = readdir(dp); ep != NULL; ep = readdir(dp))
         if (strstr(ep->d_name, ".elf")) {
             sprintf(tmp, "../build/release/user/%s", ep->d_name);
-            int file_size = load_file(tmp, inode);
-            printf("[INFO] Load ino=%d, %s: %d bytes\n", app_ino, ep->d_name,
-                   file_size);
-
-            /* Write the ELF format application binary into inode app_ino. */
-            for (uint b = 0; b * BLOCK_SIZE < file_size; b++)
-                filesys->write(filesys, app_ino, b,
-                               (void*)(inode + b * BLOCK_SIZE));
+            load_elf(filesys, app_ino, tmp);
 
             /* Add the corresponding file entry into the /bin directory. */
             ep->d_name[strlen(ep->d_name) - 4] = 0;
@@ -125,12 +256,16 @@ int main() {
         }
     closedir(dp);
     filesys->write(filesys, BIN_DIR_INODE, 0, (void*)bin_dir);
-    printf("[INFO] Load ino=%ld, %s\n", BIN_DIR_INODE, bin_dir);
+    printf("[INFO] Load ino=%d, %s\n", BIN_DIR_INODE, bin_dir);
+
+    /* Write the free list, which treedisk keeps in memory until now. */
+    if (FILESYS == 1) assert(treedisk_sync(filesys) >= 0);
 
     /* Generate the disk image file. */
     int fd  = open("disk.img", O_CREAT | O_WRONLY, 0666);
     int sz1 = write(fd, exec, SIZE_2MB);
     sz1 += write(fd, fs, SIZE_2MB);
+    sz1 += write(fd, swap, SWAP_DISK_SIZE);
     close(fd);
 
     /* Generate the ROM image files. */
@@ -147,7 +282,7 @@ int main() {
     /* Simply pad the image to 32MB which is required by QEMU. */
     close(fd);
 
-    assert(sz1 == SIZE_2MB * 2 && sz2 == SIZE_2MB * 4 && sz3 == SIZE_2MB * 16);
+    assert(sz1 == SIZE_2MB * 3 && sz2 == SIZE_2MB * 4 && sz3 == SIZE_2MB * 16);
     printf("[INFO] Finish making the image files\n");
     return 0;
 }